@@ -0,0 +1,114 @@
+/**
+ * @file herrlog_allocations.cc
+ * @author Saphereye
+ * @brief Checks that, after warm-up, a log call makes no heap allocations
+ * on the logging thread when its message fits in the inline storage of
+ * herrlog_detail::Buffer, in synchronous, asynchronous and deferred mode.
+ * @note Requires C++20 or later. Build with
+ * g++ -std=c++20 -O2 -pthread bench/herrlog_allocations.cc -o
+ * herrlog-allocations
+ *
+ * Usage: herrlog-allocations [-n messages]
+ *
+ * @copyright Copyright (c) 2023 Adarsh Das
+ *
+ * MIT License, see herrlog.hh
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <string_view>
+
+#include "../herrlog.hh"
+
+namespace {
+
+// Allocations made by the current thread, the writer thread is not counted
+thread_local std::uint64_t allocation_count = 0;
+
+/**
+ * @brief Logs messages of every argument kind formatted without a stream.
+ *
+ * @param messages
+ */
+void log_messages(std::uint64_t messages) {
+    const std::string user = "alice";
+    for (std::uint64_t index = 0; index < messages; index++) {
+        Logger::info("request {} from {} took {:.3f} ms, cached: {}", index,
+                     user, static_cast<double>(index) / 7, index % 2 == 0);
+        Logger::warn("{name} retried {count} times", arg<"name">("fetch"),
+                     arg<"count">(static_cast<int>(index % 5)));
+    }
+}
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+    allocation_count++;
+    if (void* pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+// GCC takes the frees below for mismatches with the operator new above
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+void operator delete(void* pointer) noexcept { std::free(pointer); }
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+#pragma GCC diagnostic pop
+
+int main(int argc, char** argv) {
+    std::uint64_t messages = 10000;
+    const std::uint64_t warm_up_messages = 1;
+    for (int index = 1; index < argc; index++) {
+        const std::string_view option(argv[index]);
+        if (option == "-n" && index + 1 < argc) {
+            messages = std::strtoull(argv[++index], nullptr, 10);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [-n messages]\n";
+            return 2;
+        }
+    }
+
+    std::ofstream null_stream("/dev/null");
+    Logger::set_output_buffer(null_stream);
+
+    int status = 0;
+    const struct {
+        const char* name;
+        bool is_async;
+        bool is_deferred_formatting;
+    } modes[] = {{"sync", false, false},
+                 {"async", true, false},
+                 {"deferred", true, true}};
+    for (const auto& mode : modes) {
+        Logger::set_async(mode.is_async);
+        Logger::set_is_deferred_formatting(mode.is_deferred_formatting);
+        // The first call makes the thread's buffers and queue shard, whose
+        // records are all reserved up front
+        log_messages(warm_up_messages);
+        Logger::flush();
+
+        const std::uint64_t start_count = allocation_count;
+        log_messages(messages);
+        const std::uint64_t allocations = allocation_count - start_count;
+        Logger::flush();
+        std::cout << mode.name << ": " << allocations << " allocations for "
+                  << 2 * messages << " messages\n";
+        if (allocations != 0) {
+            status = 1;
+        }
+    }
+
+    Logger::set_async(false);
+    Logger::set_output_buffer(std::cout);
+    return status;
+}
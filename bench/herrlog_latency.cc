@@ -0,0 +1,121 @@
+/**
+ * @file herrlog_latency.cc
+ * @author Saphereye
+ * @brief Times a log call of every level in synchronous and asynchronous
+ * mode, and fails when one is slower than a limit, so that a stall in a
+ * level (such as the sleep Logger::info once had) is caught.
+ * @note Requires C++20 or later. Build with
+ * g++ -std=c++20 -O2 -pthread bench/herrlog_latency.cc -o herrlog-latency
+ *
+ * Usage: herrlog-latency [-n messages] [-l limit_ns]
+ *
+ * @copyright Copyright (c) 2023 Adarsh Das
+ *
+ * MIT License, see herrlog.hh
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+
+#include "../herrlog.hh"
+
+namespace {
+
+/**
+ * @brief A level that can be logged in a loop, error and fatal end the
+ * program so they are left out.
+ *
+ */
+struct Level {
+    const char* name;
+    void (*log)(std::uint64_t index);
+};
+
+constexpr Level levels[] = {
+    {"trace", [](std::uint64_t index) { Logger::trace("message {}", index); }},
+    {"debug", [](std::uint64_t index) { Logger::debug("message {}", index); }},
+    {"info", [](std::uint64_t index) { Logger::info("message {}", index); }},
+    {"warn", [](std::uint64_t index) { Logger::warn("message {}", index); }},
+};
+
+/**
+ * @brief Logs messages at a level and returns the mean and the slowest call.
+ *
+ * @param level
+ * @param messages
+ * @param max_ns slowest call, in nanoseconds
+ * @return double mean call, in nanoseconds
+ */
+double time_level(const Level& level, std::uint64_t messages,
+                  std::int64_t& max_ns) {
+    max_ns = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto previous = start;
+    for (std::uint64_t index = 0; index < messages; index++) {
+        level.log(index);
+        const auto now = std::chrono::steady_clock::now();
+        max_ns = std::max<std::int64_t>(
+            max_ns, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        now - previous)
+                        .count());
+        previous = now;
+    }
+    Logger::flush();
+    const auto total = std::chrono::steady_clock::now() - start;
+    return static_cast<double>(
+               std::chrono::duration_cast<std::chrono::nanoseconds>(total)
+                   .count()) /
+           static_cast<double>(messages);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::uint64_t messages = 100000;
+    double limit_ns = 20000;
+    for (int index = 1; index < argc; index++) {
+        const std::string_view option(argv[index]);
+        if (option == "-n" && index + 1 < argc) {
+            messages = std::strtoull(argv[++index], nullptr, 10);
+        } else if (option == "-l" && index + 1 < argc) {
+            limit_ns = std::strtod(argv[++index], nullptr);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [-n messages] [-l limit_ns]\n";
+            return 2;
+        }
+    }
+    if (messages == 0) {
+        std::cerr << argv[0] << ": -n must be positive\n";
+        return 2;
+    }
+
+    std::ofstream null_stream("/dev/null");
+    Logger::set_output_buffer(null_stream);
+
+    int status = 0;
+    for (const bool is_async : {false, true}) {
+        Logger::set_async(is_async);
+        for (const Level& level : levels) {
+            std::int64_t max_ns = 0;
+            const double mean_ns = time_level(level, messages, max_ns);
+            const bool is_too_slow = mean_ns > limit_ns;
+            std::cout << (is_async ? "async " : "sync  ") << level.name
+                      << ": mean " << mean_ns << " ns, max " << max_ns
+                      << " ns" << (is_too_slow ? "  SLOWER THAN LIMIT" : "")
+                      << "\n";
+            if (is_too_slow) {
+                status = 1;
+            }
+        }
+    }
+
+    Logger::set_async(false);
+    Logger::set_output_buffer(std::cout);
+    return status;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file herrlog_scaling.cc
+ * @author Saphereye
+ * @brief Measures logging throughput with 1, 2, 4, ... threads logging at
+ * once, in synchronous and asynchronous mode, to see how the per-thread
+ * queue shards scale. Fails when, in asynchronous mode, the most threads
+ * the machine runs besides the writer thread log less than min_efficiency
+ * times as fast per thread as a single thread. Synchronous mode writes
+ * every message under one lock and is not checked.
+ * @note Requires C++20 or later. Build with
+ * g++ -std=c++20 -O2 -pthread bench/herrlog_scaling.cc -o herrlog-scaling
+ *
+ * Usage: herrlog-scaling [-n messages_per_thread] [-t max_threads]
+ * [-e min_efficiency]
+ *
+ * @copyright Copyright (c) 2023 Adarsh Das
+ *
+ * MIT License, see herrlog.hh
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "../herrlog.hh"
+
+namespace {
+
+/**
+ * @brief Logs from several threads at once.
+ *
+ * @param thread_count
+ * @param messages per thread
+ * @param logging_ns time until every thread logged its messages
+ * @return double time until they are also written, in nanoseconds
+ */
+double time_threads(unsigned thread_count, std::uint64_t messages,
+                    double& logging_ns) {
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned thread = 0; thread < thread_count; thread++) {
+        threads.emplace_back([messages, thread] {
+            for (std::uint64_t index = 0; index < messages; index++) {
+                Logger::info("thread {} message {}", thread, index);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    const auto logged = std::chrono::steady_clock::now();
+    Logger::flush();
+    const auto written = std::chrono::steady_clock::now();
+    logging_ns = static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(logged - start)
+            .count());
+    return static_cast<double>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(written - start)
+            .count());
+}
+
+/**
+ * @brief Messages per second the logging threads log, not counting the
+ * time to write them.
+ *
+ * @param thread_count
+ * @param messages per thread
+ * @return double
+ */
+double get_logged_throughput(unsigned thread_count, std::uint64_t messages) {
+    double logging_ns = 0;
+    time_threads(thread_count, messages, logging_ns);
+    return static_cast<double>(messages) * thread_count * 1e9 / logging_ns;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::uint64_t messages = 200000;
+    unsigned max_threads = std::max(8u, std::thread::hardware_concurrency());
+    double min_efficiency = 0.5;
+    for (int index = 1; index < argc; index++) {
+        const std::string_view option(argv[index]);
+        if (option == "-n" && index + 1 < argc) {
+            messages = std::strtoull(argv[++index], nullptr, 10);
+        } else if (option == "-t" && index + 1 < argc) {
+            max_threads =
+                static_cast<unsigned>(std::strtoul(argv[++index], nullptr, 10));
+        } else if (option == "-e" && index + 1 < argc) {
+            min_efficiency = std::strtod(argv[++index], nullptr);
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                      << " [-n messages_per_thread] [-t max_threads]"
+                         " [-e min_efficiency]\n";
+            return 2;
+        }
+    }
+    if (messages == 0) {
+        std::cerr << argv[0] << ": -n must be positive\n";
+        return 2;
+    }
+
+    std::ofstream null_stream("/dev/null");
+    Logger::set_output_buffer(null_stream);
+
+    std::cout << "mode   threads   logged msg/s  written msg/s\n";
+    for (const bool is_async : {false, true}) {
+        Logger::set_async(is_async);
+        for (unsigned thread_count = 1; thread_count <= max_threads;
+             thread_count *= 2) {
+            double logging_ns = 0;
+            const double total_ns =
+                time_threads(thread_count, messages, logging_ns);
+            const double total_messages =
+                static_cast<double>(messages) * thread_count;
+            std::cout << (is_async ? "async " : "sync  ") << std::setw(8)
+                      << thread_count << std::setw(15)
+                      << static_cast<std::uint64_t>(total_messages * 1e9 /
+                                                    logging_ns)
+                      << std::setw(15)
+                      << static_cast<std::uint64_t>(total_messages * 1e9 /
+                                                    total_ns)
+                      << "\n";
+        }
+    }
+
+    // Leave a core to the writer thread. Messages it cannot take in time
+    // are dropped, so that only the logging threads are measured.
+    const unsigned hardware_threads = std::thread::hardware_concurrency();
+    unsigned checked_threads = 1;
+    while (checked_threads * 2 <= max_threads &&
+           checked_threads * 2 < hardware_threads) {
+        checked_threads *= 2;
+    }
+    int status = 0;
+    if (checked_threads == 1) {
+        std::cout << "scaling not checked, " << hardware_threads
+                  << " hardware threads\n";
+    } else {
+        Logger::set_async(true);
+        Logger::set_overflow_policy(OverflowPolicy::DropNewest);
+        const double single_throughput = get_logged_throughput(1, messages);
+        const double throughput =
+            get_logged_throughput(checked_threads, messages);
+        const double efficiency =
+            throughput / (single_throughput * checked_threads);
+        const bool is_too_slow = efficiency < min_efficiency;
+        std::cout << "async " << checked_threads << " threads, dropping: "
+                  << std::fixed << std::setprecision(2) << efficiency
+                  << " of linear scaling"
+                  << (is_too_slow ? "  BELOW LIMIT" : "") << "\n";
+        if (is_too_slow) {
+            status = 1;
+        }
+        Logger::set_overflow_policy(OverflowPolicy::Block);
+    }
+
+    Logger::set_async(false);
+    Logger::set_output_buffer(std::cout);
+    return status;
+}
@@ -31,16 +31,80 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <filesystem>
 #include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <ostream>
-#include <sstream>
+#include <source_location>
+#include <span>
+#include <streambuf>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HERRLOG_HAS_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HERRLOG_WITH_ZLIB
+#include <zlib.h>
+#endif
 
 static_assert(__cplusplus >= 202002L,
               "This library requires at least C++20 to compile");
 
+/**
+ * @brief Log types compiled in, as a bitmask of LogType values. Calls of the
+ * other types compile to nothing, and through the HERRLOG_* macros their
+ * arguments are not even evaluated. E.g. -DHERRLOG_ACTIVE_LEVELS=0b111100
+ * strips trace and debug messages from a release build.
+ *
+ */
+#ifndef HERRLOG_ACTIVE_LEVELS
+#define HERRLOG_ACTIVE_LEVELS 0b111111
+#endif
+
 /**
  * @brief Set of ANSI colors, more can be found here:
  * https://gist.github.com/JBlond/2fea43a3049b38287e5e9cefc87b2124
@@ -66,138 +130,5893 @@ class LogType {
    private:
     std::uint8_t bitflag;
 
-   public:
+   public:
+    /**
+     * @brief Enum defining different log types as bit flags.
+     *
+     */
+    enum : std::uint8_t {
+        Trace = 0b000001,  // For specific details
+        Debug = 0b000010,  // Temporary debug printing
+        Info = 0b000100,  // General purpose details, e.g. "Program has started"
+        Error = 0b001000,  // For errors, exits the program
+        Warn = 0b010000,   // For reporting warning, the program keeps working
+        Fatal = 0b100000,  // Program exits and produces core dump
+
+        All = 0b111111,
+        None = 0b000000,
+    };
+
+    /**
+     * @brief Construct a new Log Type object. Allows implicit conversion from
+     * uint8_t. Thus allows assignments like LogType Logger::log_type =
+     * LogType::All;
+     *
+     * @param initial_flag
+     */
+    LogType(std::uint8_t initial_flag) : bitflag(initial_flag) {}
+
+    /**
+     * @brief Overloading the `|` operator for combining log types.
+     * @param other
+     * @return LogType
+     */
+    LogType operator|(const LogType other) const {
+        return LogType((static_cast<std::uint8_t>(bitflag) |
+                        static_cast<std::uint8_t>(other.bitflag)));
+    }
+
+    /**
+     * @brief Overloading the `&` operator for checking if a log type is set.
+     *
+     * @param other
+     * @return true if the bit is set in both operands
+     * @return false otherwise
+     */
+    bool operator&(const LogType other) const {
+        return static_cast<bool>(static_cast<std::uint8_t>(bitflag) &
+                                 static_cast<std::uint8_t>(other.bitflag));
+    }
+
+    /**
+     * @brief The bit flags of the log type, e.g. to store it.
+     *
+     * @return std::uint8_t
+     */
+    std::uint8_t get_bitflag() const { return bitflag; }
+};
+
+/**
+ * @brief Reports a format string whose number of {} placeholders differs from
+ * the number of arguments. Being not constexpr, reaching it while parsing a
+ * FormatString makes the call fail to compile.
+ *
+ */
+inline void placeholder_count_does_not_match_argument_count() {}
+
+/**
+ * @brief Reports a malformed {:...} format specification at compile time.
+ *
+ */
+inline void invalid_format_specification() {}
+
+/**
+ * @brief Reports a format specification that does not apply to the type of
+ * its argument at compile time, e.g. {:x} for a string.
+ *
+ */
+inline void format_specification_does_not_match_argument() {}
+
+/**
+ * @brief Reports at compile time a {name} placeholder without an argument of
+ * that name.
+ *
+ */
+inline void unknown_argument_name() {}
+
+/**
+ * @brief Reports at compile time a {n} placeholder past the last argument.
+ *
+ */
+inline void argument_index_out_of_range() {}
+
+/**
+ * @brief Reports at compile time a format string mixing {} and {n}, which
+ * would make the order of the arguments ambiguous.
+ *
+ */
+inline void cannot_mix_automatic_and_positional_placeholders() {}
+
+/**
+ * @brief Reports at compile time an argument that no positional or named
+ * placeholder refers to.
+ *
+ */
+inline void argument_is_not_used() {}
+
+/**
+ * @brief Reports at compile time a placeholder referring to a kv field,
+ * fields are not part of the message text.
+ *
+ */
+inline void placeholder_cannot_refer_to_field() {}
+
+/**
+ * @brief Reports at compile time a format string with more placeholders than
+ * FormatString::max_placeholders.
+ *
+ */
+inline void too_many_placeholders() {}
+
+/**
+ * @brief Reports at compile time a format string too long for the offsets of
+ * its segments.
+ *
+ */
+inline void format_string_too_long() {}
+
+/**
+ * @brief A string literal usable as a template argument, names named
+ * arguments.
+ *
+ * @tparam Size
+ */
+template <std::size_t Size>
+struct FixedString {
+    char text[Size]{};
+
+    consteval FixedString(const char (&text)[Size]) {
+        std::copy_n(text, Size, this->text);
+    }
+
+    constexpr std::string_view view() const {
+        return std::string_view(text, Size - 1);
+    }
+};
+
+/**
+ * @brief An argument referred to by a {name} placeholder, see arg.
+ *
+ * @tparam Name
+ * @tparam T
+ */
+template <FixedString Name, typename T>
+struct NamedArgument {
+    const T& value;
+};
+
+/**
+ * @brief Names an argument for {name} placeholders, e.g.
+ * Logger::info("{user} logged in", arg<"user">(user_name)).
+ *
+ * @tparam Name
+ * @tparam T
+ * @param value
+ * @return NamedArgument<Name, T>
+ */
+template <FixedString Name, typename T>
+NamedArgument<Name, T> arg(const T& value) {
+    return {value};
+}
+
+/**
+ * @brief A structured field of a message, see kv.
+ *
+ * @tparam T
+ */
+template <typename T>
+struct KeyValue {
+    std::string_view key;
+    const T& value;
+};
+
+/**
+ * @brief Attaches a structured field to a message, e.g.
+ * Logger::info("request done", kv("latency_us", latency)). Fields take no
+ * placeholder, they are appended as key=value by the text encoder and as
+ * JSON members by the JSON Lines encoder.
+ *
+ * @tparam T
+ * @param key
+ * @param value
+ * @return KeyValue<T>
+ */
+template <typename T>
+KeyValue<T> kv(std::string_view key, const T& value) {
+    return {key, value};
+}
+
+/**
+ * @brief Parsed {:...} format specification, a subset of the std::format
+ * mini language: [[fill]align][sign][#][0][width][.precision][type].
+ *
+ */
+struct FormatSpec {
+    char fill = ' ';
+    // '<', '>', '^', or '\0' for the default of the argument type
+    char align = '\0';
+    // '-', '+' or ' '
+    char sign = '-';
+    // One of "dxXobBeEfFgGsc", or '\0' for the default of the argument type
+    char type = '\0';
+    // '#': 0x, 0 and 0b prefixes
+    bool is_alternate = false;
+    bool is_zero_padded = false;
+    std::uint16_t width = 0;
+    // -1 when not given
+    std::int16_t precision = -1;
+
+    constexpr bool is_default() const {
+        return align == '\0' && sign == '-' && type == '\0' && !is_alternate &&
+               !is_zero_padded && width == 0 && precision == -1;
+    }
+};
+
+namespace herrlog_detail {
+
+/**
+ * @brief Characters are appended as is, like operator<< does.
+ *
+ * @tparam T
+ */
+template <typename T>
+inline constexpr bool is_character_v =
+    std::is_same_v<T, char> || std::is_same_v<T, signed char> ||
+    std::is_same_v<T, unsigned char>;
+
+/**
+ * @brief What a format specification may do to an argument.
+ *
+ */
+enum class ArgumentKind : std::uint8_t {
+    Bool,
+    Character,
+    Integer,
+    Float,
+    String,
+    Other,
+    Field,
+};
+
+template <typename T>
+inline constexpr bool is_key_value_v = false;
+
+template <typename T>
+inline constexpr bool is_key_value_v<KeyValue<T>> = true;
+
+/**
+ * @brief Named arguments are formatted as their value.
+ *
+ * @tparam T
+ */
+template <typename T>
+struct UnwrappedArgument {
+    using type = T;
+};
+
+template <FixedString Name, typename T>
+struct UnwrappedArgument<NamedArgument<Name, T>> {
+    using type = T;
+};
+
+template <typename T>
+using unwrapped_t = typename UnwrappedArgument<T>::type;
+
+template <typename T>
+const T& unwrap_argument(const T& argument) {
+    return argument;
+}
+
+template <FixedString Name, typename T>
+const T& unwrap_argument(const NamedArgument<Name, T>& argument) {
+    return argument.value;
+}
+
+/**
+ * @brief Name of a named argument, empty for the others.
+ *
+ * @tparam T
+ */
+template <typename T>
+inline constexpr std::string_view argument_name_v{};
+
+template <FixedString Name, typename T>
+inline constexpr std::string_view argument_name_v<NamedArgument<Name, T>> =
+    Name.view();
+
+template <typename T>
+consteval ArgumentKind get_argument_kind() {
+    using Type = std::remove_cvref_t<unwrapped_t<T>>;
+    if constexpr (is_key_value_v<Type>) {
+        return ArgumentKind::Field;
+    } else if constexpr (std::is_same_v<Type, bool>) {
+        return ArgumentKind::Bool;
+    } else if constexpr (is_character_v<Type>) {
+        return ArgumentKind::Character;
+    } else if constexpr (std::is_integral_v<Type>) {
+        return ArgumentKind::Integer;
+    } else if constexpr (std::is_floating_point_v<Type>) {
+        return ArgumentKind::Float;
+    } else if constexpr (std::is_convertible_v<const Type&, std::string_view>) {
+        return ArgumentKind::String;
+    } else {
+        return ArgumentKind::Other;
+    }
+}
+
+/**
+ * @brief Parses the specification between "{:" and "}", reporting errors
+ * at compile time. Also run again on checked literals, see
+ * FormatString::from_checked_literal.
+ *
+ * @param text specification without the braces and colon
+ * @param kind kind of the argument it applies to
+ * @return FormatSpec
+ */
+constexpr FormatSpec parse_format_spec(std::string_view text,
+                                       ArgumentKind kind) {
+    const auto is_align = [](char character) {
+        return character == '<' || character == '>' || character == '^';
+    };
+    const auto is_digit = [](char character) {
+        return character >= '0' && character <= '9';
+    };
+    const auto parse_number = [&](std::size_t& index) {
+        std::uint32_t number = 0;
+        while (index < text.size() && is_digit(text[index])) {
+            number = number * 10 + static_cast<std::uint32_t>(text[index] - '0');
+            if (number > 32767) {
+                invalid_format_specification();
+            }
+            index++;
+        }
+        return number;
+    };
+
+    FormatSpec spec;
+    std::size_t index = 0;
+    if (text.size() >= 2 && is_align(text[1])) {
+        spec.fill = text[0];
+        spec.align = text[1];
+        index = 2;
+    } else if (!text.empty() && is_align(text[0])) {
+        spec.align = text[0];
+        index = 1;
+    }
+    if (index < text.size() &&
+        (text[index] == '+' || text[index] == '-' || text[index] == ' ')) {
+        spec.sign = text[index++];
+    }
+    if (index < text.size() && text[index] == '#') {
+        spec.is_alternate = true;
+        index++;
+    }
+    if (index < text.size() && text[index] == '0') {
+        spec.is_zero_padded = true;
+        index++;
+    }
+    spec.width = static_cast<std::uint16_t>(parse_number(index));
+    if (index < text.size() && text[index] == '.') {
+        index++;
+        if (index == text.size() || !is_digit(text[index])) {
+            invalid_format_specification();
+        }
+        spec.precision = static_cast<std::int16_t>(parse_number(index));
+    }
+    if (index < text.size() &&
+        std::string_view("dxXobBeEfFgGsc").find(text[index]) !=
+            std::string_view::npos) {
+        spec.type = text[index++];
+    }
+    if (index != text.size()) {
+        invalid_format_specification();
+    }
+
+    const bool is_number =
+        kind == ArgumentKind::Integer || kind == ArgumentKind::Float;
+    const bool is_integer_type =
+        std::string_view("dxXobB").find(spec.type) != std::string_view::npos;
+    const bool is_float_type =
+        std::string_view("eEfFgG").find(spec.type) != std::string_view::npos;
+    bool is_valid = true;
+    switch (kind) {
+        case ArgumentKind::Bool:
+            is_valid = spec.type == '\0' || spec.type == 's' || is_integer_type;
+            break;
+        case ArgumentKind::Character:
+            is_valid = spec.type == '\0' || spec.type == 'c' || is_integer_type;
+            break;
+        case ArgumentKind::Integer:
+            is_valid = spec.type == '\0' || spec.type == 'c' || is_integer_type;
+            break;
+        case ArgumentKind::Float:
+            is_valid = spec.type == '\0' || is_float_type;
+            break;
+        case ArgumentKind::String:
+            is_valid = spec.type == '\0' || spec.type == 's';
+            break;
+        case ArgumentKind::Other:
+        case ArgumentKind::Field:
+            is_valid = spec.type == '\0';
+            break;
+    }
+    // Signs, prefixes and zero padding are for numbers, precision for
+    // floating point and strings
+    const bool is_integer_presentation =
+        is_number || (kind != ArgumentKind::String &&
+                      kind != ArgumentKind::Other && is_integer_type);
+    if ((spec.sign != '-' || spec.is_alternate || spec.is_zero_padded) &&
+        !is_integer_presentation) {
+        is_valid = false;
+    }
+    if (spec.precision != -1 && kind != ArgumentKind::Float &&
+        kind != ArgumentKind::String) {
+        is_valid = false;
+    }
+    if (!is_valid) {
+        format_specification_does_not_match_argument();
+    }
+    return spec;
+}
+
+}  // namespace herrlog_detail
+
+/**
+ * @brief Where a message is logged from. Everything is worked out at compile
+ * time: the strings point into the static data of std::source_location, the
+ * file without its directories and the function without its return type and
+ * parameters.
+ *
+ */
+struct SourceLocation {
+    const char* file = "";
+    std::uint32_t line = 0;
+    std::string_view function;
+
+    constexpr SourceLocation() = default;
+
+    /**
+     * @brief Construct a new Source Location object, usually from
+     * std::source_location::current().
+     *
+     * @param location
+     */
+    consteval SourceLocation(const std::source_location& location)
+        : file(location.file_name()), line(location.line()) {
+        for (const char* character = file; *character != '\0'; character++) {
+            if (*character == '/' || *character == '\\') {
+                file = character + 1;
+            }
+        }
+
+        // E.g. "void ns::Server::run(int)" or, in a lambda,
+        // "ns::Server::run(int)::<lambda()>"
+        std::string_view name(location.function_name());
+        name = name.substr(0, name.find("::<lambda"));
+        std::size_t depth = 0;
+        std::size_t start = 0;
+        bool is_operator = false;
+        for (std::size_t index = 0; index < name.size(); index++) {
+            const char character = name[index];
+            if (depth == 0 && (index == start || name[index - 1] == ':') &&
+                name.substr(index).starts_with("operator") &&
+                (index + 8 == name.size() ||
+                 !is_identifier_character(name[index + 8]))) {
+                // E.g. "operator()", "operator<" or "operator int", whose
+                // characters would otherwise be taken for the parameters,
+                // templates or the return type
+                const std::size_t symbol = index + 8;
+                is_operator = true;
+                name = name.substr(
+                    0, name.find('(', name.substr(symbol).starts_with("()")
+                                          ? symbol + 2
+                                          : symbol));
+                break;
+            }
+            if (character == '<') {
+                depth++;
+            } else if (character == '>' && depth != 0) {
+                depth--;
+            } else if (depth == 0 && character == ' ') {
+                start = index + 1;
+            } else if (depth == 0 && character == '(' && index != start) {
+                name = name.substr(0, index);
+                break;
+            }
+        }
+        name = name.substr(std::min(start, name.size()));
+        // Template arguments, only named in lambdas
+        if (!is_operator && name.ends_with('>')) {
+            depth = 0;
+            for (std::size_t index = name.size(); index-- > 0;) {
+                depth += name[index] == '>';
+                depth -= name[index] == '<';
+                if (depth == 0) {
+                    name = name.substr(0, index);
+                    break;
+                }
+            }
+        }
+        function = name;
+    }
+
+   private:
+    static constexpr bool is_identifier_character(char character) {
+        return (character >= 'a' && character <= 'z') ||
+               (character >= 'A' && character <= 'Z') ||
+               (character >= '0' && character <= '9') || character == '_';
+    }
+};
+
+/**
+ * @brief A format string checked and split at compile time. Every literal
+ * passed to the logging functions is converted to one, so a mismatch between
+ * the placeholders and the arguments is a compile error, and at runtime only
+ * the precomputed literal segments between the arguments are written.
+ * Placeholders are {} for the next argument, {n} for the n-th one or {name}
+ * for the argument named with arg, each optionally followed by :spec, see
+ * FormatSpec. {{ and }} are written as { and }, and a { that starts none of
+ * them is written as is.
+ *
+ * @tparam Args
+ */
+template <typename... Args>
+class FormatString {
+   public:
+    static_assert(sizeof...(Args) <= 255, "Too many arguments");
+
+    // Placeholders may repeat arguments, up to this many
+    static constexpr std::size_t max_placeholders =
+        sizeof...(Args) == 0 ? 0 : 32;
+
+    // Where a literal segment is in the format string, smaller than a
+    // string_view
+    struct Segment {
+        std::uint16_t start = 0;
+        std::uint16_t size = 0;
+    };
+
+    const char* literal = "";
+    // Literal text before each placeholder, followed by the text after the
+    // last, see segment
+    std::array<Segment, max_placeholders + 1> segments{};
+    // Specification of each placeholder
+    std::array<FormatSpec, max_placeholders> specs{};
+    // Argument of each placeholder
+    std::array<std::uint8_t, max_placeholders> argument_indexes{};
+    std::size_t placeholder_count = 0;
+    // Whether placeholders are not simply the arguments in order
+    bool is_positional = false;
+    // Whether any placeholder has a specification other than the default
+    bool has_specs = false;
+    // Whether the segments contain {{ or }}
+    bool has_escapes = false;
+    // Where the format string is passed from
+    SourceLocation location;
+
+    /**
+     * @brief Construct a new Format String object from a string literal.
+     *
+     * @param format
+     * @param location of the call, captured by the default argument
+     */
+    consteval FormatString(
+        const char* format,
+        SourceLocation location = std::source_location::current())
+        : literal(format), location(location) {
+        parse();
+    }
+
+    /**
+     * @brief Rebuilds at runtime the format object of a literal that was
+     * already checked at compile time, i.e. the literal of a FormatString of
+     * the same arguments. The object holds a table for max_placeholders
+     * whatever the literal, so the asynchronous and binary backends carry
+     * the literal instead of copying the object into every record.
+     *
+     * @param format
+     * @param location
+     * @return FormatString
+     */
+    static FormatString from_checked_literal(const char* format,
+                                             SourceLocation location = {}) {
+        return FormatString(CheckedLiteral{}, format, location);
+    }
+
+    /**
+     * @brief The literal text before the placeholder at index, or after the
+     * last one, with {{ and }} still escaped, see append_segment.
+     *
+     * @param index
+     * @return std::string_view
+     */
+    constexpr std::string_view segment(std::size_t index) const {
+        return std::string_view(literal + segments[index].start,
+                                segments[index].size);
+    }
+
+   private:
+    struct CheckedLiteral {};
+
+    constexpr FormatString(CheckedLiteral, const char* format,
+                           SourceLocation location)
+        : literal(format), location(location) {
+        parse();
+    }
+
+    /**
+     * @brief Splits literal into segments and placeholders. Errors are
+     * reported at compile time, by the consteval constructor.
+     *
+     */
+    constexpr void parse() {
+        constexpr std::array<herrlog_detail::ArgumentKind, sizeof...(Args)>
+            kinds{herrlog_detail::get_argument_kind<Args>()...};
+        constexpr std::array<std::string_view, sizeof...(Args)> names{
+            herrlog_detail::argument_name_v<Args>...};
+        const auto is_digit = [](char character) {
+            return character >= '0' && character <= '9';
+        };
+        const auto is_name_start = [](char character) {
+            return (character >= 'a' && character <= 'z') ||
+                   (character >= 'A' && character <= 'Z') || character == '_';
+        };
+
+        const auto is_field = [&](std::size_t argument) {
+            return kinds[argument] == herrlog_detail::ArgumentKind::Field;
+        };
+
+        const std::string_view text(literal);
+        if (text.size() > std::numeric_limits<std::uint16_t>::max()) {
+            format_string_too_long();
+        }
+        std::size_t segment_start = 0;
+        std::size_t next_argument = 0;
+        // Argument the placeholder takes when they simply go in order
+        std::size_t in_order_argument = 0;
+        bool is_automatic = false;
+        bool is_numbered = false;
+        bool is_named = false;
+        std::array<bool, sizeof...(Args)> is_used{};
+        std::size_t field_count = 0;
+        for (std::size_t argument = 0; argument < sizeof...(Args);
+             argument++) {
+            // Fields need no placeholder
+            is_used[argument] = is_field(argument);
+            field_count += is_field(argument);
+        }
+        for (std::size_t index = 0; index < text.size(); index++) {
+            if (index + 1 == text.size() ||
+                (text[index] != '{' && text[index] != '}')) {
+                continue;
+            }
+            const char next = text[index + 1];
+            if (next == text[index]) {
+                has_escapes = true;
+                index++;
+                continue;
+            }
+            if (text[index] == '}') {
+                continue;
+            }
+            if (next != '}' && next != ':' && !is_digit(next) &&
+                !is_name_start(next)) {
+                continue;
+            }
+            const std::size_t end = text.find('}', index);
+            if (end == std::string_view::npos) {
+                invalid_format_specification();
+            }
+            if (placeholder_count == max_placeholders) {
+                if constexpr (sizeof...(Args) == 0) {
+                    placeholder_count_does_not_match_argument_count();
+                }
+                too_many_placeholders();
+            }
+            const std::string_view field =
+                text.substr(index + 1, end - index - 1);
+            const std::size_t colon = field.find(':');
+            const std::string_view id = field.substr(0, colon);
+
+            std::size_t argument = 0;
+            if (id.empty()) {
+                // Named arguments are only referred to by name
+                is_automatic = true;
+                while (next_argument < sizeof...(Args) &&
+                       (!names[next_argument].empty() ||
+                        is_field(next_argument))) {
+                    next_argument++;
+                }
+                argument = next_argument++;
+                if (argument >= sizeof...(Args)) {
+                    placeholder_count_does_not_match_argument_count();
+                }
+            } else if (is_digit(id[0])) {
+                is_numbered = true;
+                for (const char character : id) {
+                    if (!is_digit(character)) {
+                        invalid_format_specification();
+                    }
+                    argument = argument * 10 +
+                               static_cast<std::size_t>(character - '0');
+                    if (argument >= sizeof...(Args)) {
+                        argument_index_out_of_range();
+                    }
+                }
+            } else {
+                is_named = true;
+                argument = static_cast<std::size_t>(
+                    std::find(names.begin(), names.end(), id) - names.begin());
+                if (argument == sizeof...(Args)) {
+                    unknown_argument_name();
+                }
+            }
+            if (is_automatic && is_numbered) {
+                cannot_mix_automatic_and_positional_placeholders();
+            }
+            if (is_field(argument)) {
+                placeholder_cannot_refer_to_field();
+            }
+
+            if (colon != std::string_view::npos) {
+                specs[placeholder_count] = herrlog_detail::parse_format_spec(
+                    field.substr(colon + 1), kinds[argument]);
+                has_specs =
+                    has_specs || !specs[placeholder_count].is_default();
+            }
+            while (in_order_argument < sizeof...(Args) &&
+                   is_field(in_order_argument)) {
+                in_order_argument++;
+            }
+            is_positional = is_positional || argument != in_order_argument++;
+            is_used[argument] = true;
+            argument_indexes[placeholder_count] =
+                static_cast<std::uint8_t>(argument);
+            segments[placeholder_count++] = make_segment(segment_start, index);
+            segment_start = end + 1;
+            index = end;
+        }
+        if (std::find(is_used.begin(), is_used.end(), false) != is_used.end()) {
+            if (!is_numbered && !is_named) {
+                placeholder_count_does_not_match_argument_count();
+            }
+            argument_is_not_used();
+        }
+        is_positional = is_positional ||
+                        placeholder_count != sizeof...(Args) - field_count;
+        segments[placeholder_count] = make_segment(segment_start, text.size());
+    }
+
+    static constexpr Segment make_segment(std::size_t start, std::size_t end) {
+        return {static_cast<std::uint16_t>(start),
+                static_cast<std::uint16_t>(end - start)};
+    }
+};
+
+/**
+ * @brief A logging call site made with one of the HERRLOG_* macros. Every one
+ * is registered before main runs, see Logger::get_call_sites.
+ *
+ */
+struct CallSite {
+    // A LogType
+    std::uint8_t type = LogType::None;
+    const char* format = "";
+    SourceLocation location;
+};
+
+/**
+ * @brief Decides what the asynchronous backend does when a message is logged
+ * while its queue is full.
+ *
+ */
+enum class OverflowPolicy : std::uint8_t {
+    Block,       // Wait for the writer thread to free a slot
+    DropNewest,  // Discard the message being logged
+    DropOldest,  // Discard the oldest queued message to make room
+};
+
+/**
+ * @brief Decides when the output buffer is flushed. The output is flushed as
+ * soon as any of the enabled conditions holds, the default flushes after
+ * every message. Whenever a policy other than the default is set, or the
+ * asynchronous backend is enabled, handlers for crashing signals and
+ * std::terminate are installed that flush what is still pending before the
+ * program dies. A signal handler can only flush sinks that write to a file
+ * descriptor (see Sink::is_flushable_from_signal), so when logging
+ * synchronously the policy only delays their flushes, other sinks such as
+ * streams are still flushed after every message. In asynchronous mode the
+ * writer thread flushes every sink on a crash, and the policy applies to all.
+ *
+ */
+struct FlushPolicy {
+    // Flush once this many messages are pending, 0 disables
+    std::uint32_t every_messages = 1;
+    // Flush once this many bytes are pending, 0 disables
+    std::size_t every_bytes = 0;
+    // Flush once the oldest pending message is this old, 0 disables. In
+    // synchronous mode it is only checked when a message is logged.
+    std::chrono::milliseconds interval{0};
+    // Flush right after messages of these types
+    LogType on_types = LogType::None;
+};
+
+/**
+ * @brief Clock read when a message is logged.
+ *
+ */
+enum class ClockSource : std::uint8_t {
+    System,  // std::chrono::system_clock
+    Tsc,     // CPU timestamp counter, converted to wall time when rendered
+};
+
+/**
+ * @brief How messages are written out.
+ *
+ */
+enum class Encoder : std::uint8_t {
+    Text,       // "[INFO time] message key=value"
+    JsonLines,  // One JSON object per line
+};
+
+/**
+ * @brief Local time boundary at which a RotatingFileSink starts a new file.
+ *
+ */
+enum class RotationSchedule : std::uint8_t {
+    None,
+    Hourly,
+    Daily,
+};
+
+/**
+ * @brief Decides when a RotatingFileSink starts a new file, whichever
+ * condition holds first, and how many old files it keeps.
+ *
+ */
+struct RotationPolicy {
+    // Rotate before the file grows past this many bytes, 0 disables
+    std::size_t max_bytes = 0;
+    RotationSchedule schedule = RotationSchedule::None;
+    // Rotated files kept as "name.1" (newest) to "name.<max_files>"
+    std::size_t max_files = 5;
+#ifdef HERRLOG_WITH_ZLIB
+    // Gzip rotated files into "name.<n>.gz"
+    bool is_compressed = false;
+#endif
+};
+
+/**
+ * @brief Internals shared by the Logger, not meant to be used directly.
+ *
+ */
+namespace herrlog_detail {
+
+/**
+ * @brief Bounded lock-free multi-producer queue, after Dmitry Vyukov's
+ * bounded MPMC queue. Each slot carries a sequence number that tells whether
+ * it is free or filled for the current lap, so producers only contend on one
+ * compare-and-swap of the enqueue position.
+ *
+ * @tparam T
+ */
+template <typename T>
+class BoundedQueue {
+   private:
+    struct Slot {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::size_t mask;
+    alignas(64) std::atomic<std::size_t> enqueue_position{0};
+    alignas(64) std::atomic<std::size_t> dequeue_position{0};
+
+   public:
+    /**
+     * @brief Construct a new Bounded Queue object, the capacity is rounded up
+     * to the next power of two.
+     *
+     * @param capacity
+     */
+    explicit BoundedQueue(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots = std::make_unique<Slot[]>(size);
+        mask = size - 1;
+        for (std::size_t index = 0; index < size; index++) {
+            slots[index].sequence.store(index, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Construct a new Bounded Queue object whose slots are prepared by
+     * initialize, e.g. to reserve buffers before they circulate.
+     *
+     * @tparam Initializer
+     * @param capacity
+     * @param initialize called with the value of every slot
+     */
+    template <typename Initializer>
+    BoundedQueue(std::size_t capacity, Initializer&& initialize)
+        : BoundedQueue(capacity) {
+        for (std::size_t index = 0; index <= mask; index++) {
+            initialize(slots[index].value);
+        }
+    }
+
+    /**
+     * @brief Swaps value into a free slot, value receives what the slot held
+     * before so buffers keep circulating instead of being reallocated.
+     *
+     * @param value
+     * @return true if the value was queued
+     * @return false if the queue is full, value is left untouched
+     */
+    bool try_push(T& value) {
+        std::size_t position = enqueue_position.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot& slot = slots[position & mask];
+            std::size_t sequence =
+                slot.sequence.load(std::memory_order_acquire);
+            std::intptr_t difference = static_cast<std::intptr_t>(sequence) -
+                                       static_cast<std::intptr_t>(position);
+            if (difference == 0) {
+                if (enqueue_position.compare_exchange_weak(
+                        position, position + 1, std::memory_order_relaxed)) {
+                    std::swap(slot.value, value);
+                    slot.sequence.store(position + 1,
+                                        std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * @brief Swaps the oldest value out of the queue.
+     *
+     * @param value
+     * @return true if a value was taken
+     * @return false if the queue is empty
+     */
+    bool try_pop(T& value) {
+        std::size_t position = dequeue_position.load();
+        for (;;) {
+            Slot& slot = slots[position & mask];
+            std::size_t sequence =
+                slot.sequence.load(std::memory_order_acquire);
+            std::intptr_t difference = static_cast<std::intptr_t>(sequence) -
+                                       static_cast<std::intptr_t>(position + 1);
+            if (difference == 0) {
+                if (dequeue_position.compare_exchange_weak(position,
+                                                           position + 1)) {
+                    std::swap(slot.value, value);
+                    slot.sequence.store(position + mask + 1,
+                                        std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeue_position.load();
+            }
+        }
+    }
+
+    /**
+     * @brief Number of slots ever claimed by producers.
+     *
+     * @return std::size_t
+     */
+    std::size_t pushed_count() const { return enqueue_position.load(); }
+
+    /**
+     * @brief Number of slots ever claimed by consumers.
+     *
+     * @return std::size_t
+     */
+    std::size_t popped_count() const { return dequeue_position.load(); }
+};
+
+/**
+ * @brief Mutex of the output that a crash signal handler may also take. A
+ * handler cannot block nor call std::mutex, so threads take the std::mutex
+ * and then an atomic flag, while a handler only tries to take the flag.
+ *
+ */
+class OutputMutex {
+   private:
+    static_assert(std::atomic<bool>::is_always_lock_free,
+                  "Signal handlers need a lock-free flag");
+
+    std::mutex mutex;
+    // Held by the owner of mutex, or by a signal handler
+    std::atomic<bool> is_held{false};
+
+   public:
+    void lock() {
+        mutex.lock();
+        while (is_held.exchange(true, std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+
+    bool try_lock() {
+        if (!mutex.try_lock()) {
+            return false;
+        }
+        if (is_held.exchange(true, std::memory_order_acquire)) {
+            mutex.unlock();
+            return false;
+        }
+        return true;
+    }
+
+    void unlock() {
+        is_held.store(false, std::memory_order_release);
+        mutex.unlock();
+    }
+
+    /**
+     * @brief Takes the flag without blocking, from a signal handler. Fails
+     * when a thread holds the mutex, possibly the interrupted one.
+     *
+     * @return true if it was taken, see unlock_from_signal
+     * @return false otherwise
+     */
+    bool try_lock_from_signal() noexcept {
+        return !is_held.exchange(true, std::memory_order_acquire);
+    }
+
+    void unlock_from_signal() noexcept {
+        is_held.store(false, std::memory_order_release);
+    }
+};
+
+/**
+ * @brief Sleeps for a millisecond in a signal handler, through nanosleep
+ * where there is one.
+ *
+ */
+inline void sleep_from_signal() noexcept {
+#if defined(__unix__)
+    timespec duration{0, 1000000};
+    nanosleep(&duration, nullptr);
+#else
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
+}
+
+/**
+ * @brief Growable character buffer messages are formatted into. Small
+ * messages fit in the inline storage, larger ones move to the heap and keep
+ * that capacity, so a reused buffer stops allocating once it has grown to the
+ * largest message.
+ *
+ */
+class Buffer {
+   private:
+    static constexpr std::size_t inline_capacity = 512;
+
+    char inline_storage[inline_capacity];
+    std::unique_ptr<char[]> heap_storage;
+    char* storage = inline_storage;
+    std::size_t length = 0;
+    std::size_t capacity = inline_capacity;
+
+   public:
+    Buffer() = default;
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    /**
+     * @brief Makes room for count more characters.
+     *
+     * @param count
+     * @return char* where the next characters go, see commit
+     */
+    char* prepare(std::size_t count) {
+        if (length + count > capacity) {
+            std::size_t new_capacity = capacity * 2;
+            while (new_capacity < length + count) {
+                new_capacity *= 2;
+            }
+            std::unique_ptr<char[]> new_storage(new char[new_capacity]);
+            std::memcpy(new_storage.get(), storage, length);
+            heap_storage = std::move(new_storage);
+            storage = heap_storage.get();
+            capacity = new_capacity;
+        }
+        return storage + length;
+    }
+
+    /**
+     * @brief Adds count characters written after a call to prepare.
+     *
+     * @param count
+     */
+    void commit(std::size_t count) { length += count; }
+
+    void append(std::string_view text) {
+        std::memcpy(prepare(text.size()), text.data(), text.size());
+        length += text.size();
+    }
+
+    void push_back(char character) {
+        *prepare(1) = character;
+        length++;
+    }
+
+    void clear() { length = 0; }
+
+    char* data() { return storage; }
+
+    const char* data() const { return storage; }
+
+    std::size_t size() const { return length; }
+
+    std::string_view view() const { return std::string_view(storage, length); }
+};
+
+/**
+ * @brief Appends a literal segment of a format string, writing {{ and }} as {
+ * and }.
+ *
+ * @tparam Format
+ * @param buffer
+ * @param format
+ * @param index of the segment
+ */
+template <typename Format>
+void append_segment(Buffer& buffer, const Format& format, std::size_t index) {
+    const std::string_view segment = format.segment(index);
+    if (!format.has_escapes) {
+        buffer.append(segment);
+        return;
+    }
+    std::size_t start = 0;
+    for (std::size_t position = 0; position + 1 < segment.size(); position++) {
+        if ((segment[position] == '{' || segment[position] == '}') &&
+            segment[position + 1] == segment[position]) {
+            buffer.append(segment.substr(start, position + 1 - start));
+            start = position + 2;
+            position++;
+        }
+    }
+    buffer.append(segment.substr(start));
+}
+
+/**
+ * @brief Lends the calling thread's formatting buffer, cleared. A buffer is
+ * allocated only if the thread's one is already lent, i.e. when an
+ * operator<< logs something itself.
+ *
+ */
+class ThreadBuffer {
+   private:
+    struct ThreadState {
+        Buffer buffer;
+        bool is_lent = false;
+    };
+
+    std::unique_ptr<Buffer> nested_buffer;
+    Buffer* buffer;
+
+    static ThreadState& thread_state() {
+        thread_local ThreadState state;
+        return state;
+    }
+
+   public:
+    ThreadBuffer() {
+        ThreadState& state = thread_state();
+        if (state.is_lent) {
+            nested_buffer = std::make_unique<Buffer>();
+            buffer = nested_buffer.get();
+        } else {
+            state.is_lent = true;
+            state.buffer.clear();
+            buffer = &state.buffer;
+        }
+    }
+
+    ThreadBuffer(const ThreadBuffer&) = delete;
+    ThreadBuffer& operator=(const ThreadBuffer&) = delete;
+
+    ~ThreadBuffer() {
+        if (!nested_buffer) {
+            thread_state().is_lent = false;
+        }
+    }
+
+    Buffer& operator*() const { return *buffer; }
+
+    Buffer* operator->() const { return buffer; }
+};
+
+/**
+ * @brief Stream buffer appending to a Buffer, lets types without a dedicated
+ * appender be formatted with their operator<<.
+ *
+ */
+class BufferStreambuf : public std::streambuf {
+   private:
+    Buffer* buffer = nullptr;
+
+   protected:
+    int_type overflow(int_type character) override {
+        if (!traits_type::eq_int_type(character, traits_type::eof())) {
+            buffer->push_back(traits_type::to_char_type(character));
+        }
+        return traits_type::not_eof(character);
+    }
+
+    std::streamsize xsputn(const char* text, std::streamsize count) override {
+        buffer->append(std::string_view(text, static_cast<std::size_t>(count)));
+        return count;
+    }
+
+   public:
+    Buffer* set_buffer(Buffer* buffer) {
+        return std::exchange(this->buffer, buffer);
+    }
+};
+
+/**
+ * @brief "00" to "99", integers are written two digits at a time.
+ *
+ */
+inline constexpr std::array<char, 200> digit_pairs = [] {
+    std::array<char, 200> pairs{};
+    for (std::size_t index = 0; index < 100; index++) {
+        pairs[index * 2] = static_cast<char>('0' + index / 10);
+        pairs[index * 2 + 1] = static_cast<char>('0' + index % 10);
+    }
+    return pairs;
+}();
+
+/**
+ * @brief Number of decimal digits of a value, four digits per division.
+ * Faster than a branchless count from the bit width for the small values
+ * that dominate logs, unless lzcnt is available.
+ *
+ * @param value
+ * @return std::size_t
+ */
+inline std::size_t digit_count(std::uint64_t value) {
+    std::size_t count = 1;
+    for (;;) {
+        if (value < 10) {
+            return count;
+        }
+        if (value < 100) {
+            return count + 1;
+        }
+        if (value < 1000) {
+            return count + 2;
+        }
+        if (value < 10000) {
+            return count + 3;
+        }
+        value /= 10000;
+        count += 4;
+    }
+}
+
+/**
+ * @brief Writes the digits of a value so that they end at last. Values
+ * below 2^32 use 32-bit divisions, which are cheaper.
+ *
+ * @tparam Unsigned
+ * @param last
+ * @param value
+ */
+template <typename Unsigned>
+void write_digits(char* last, Unsigned value) {
+    while (value >= 100) {
+        const std::size_t pair = static_cast<std::size_t>(value % 100) * 2;
+        value /= 100;
+        last -= 2;
+        std::memcpy(last, digit_pairs.data() + pair, 2);
+    }
+    if (value >= 10) {
+        std::memcpy(last - 2, digit_pairs.data() + value * 2, 2);
+    } else {
+        last[-1] = static_cast<char>('0' + value);
+    }
+}
+
+/**
+ * @brief Appends an integer in decimal.
+ *
+ * @tparam T
+ * @param buffer
+ * @param value
+ */
+template <typename T>
+    requires(sizeof(T) <= sizeof(std::uint64_t))
+void append_integer(Buffer& buffer, T value) {
+    std::uint64_t magnitude = static_cast<std::uint64_t>(value);
+    bool is_negative = false;
+    if constexpr (std::is_signed_v<T>) {
+        is_negative = value < 0;
+        if (is_negative) {
+            magnitude = 0 - magnitude;
+        }
+    }
+    const std::size_t size = digit_count(magnitude) + is_negative;
+    char* first = buffer.prepare(size);
+    *first = '-';
+    if (magnitude <= std::numeric_limits<std::uint32_t>::max()) {
+        write_digits(first + size, static_cast<std::uint32_t>(magnitude));
+    } else {
+        write_digits(first + size, magnitude);
+    }
+    buffer.commit(size);
+}
+
+/**
+ * @brief Appends an integer wider than 64 bits in decimal, e.g. __int128
+ * with GNU extensions, through std::to_chars.
+ *
+ * @tparam T
+ * @param buffer
+ * @param value
+ */
+template <typename T>
+    requires(sizeof(T) > sizeof(std::uint64_t))
+void append_integer(Buffer& buffer, T value) {
+    // 39 digits and a sign for 128 bits
+    constexpr std::size_t max_size = std::numeric_limits<T>::digits10 + 2;
+    char* first = buffer.prepare(max_size);
+    buffer.commit(std::to_chars(first, first + max_size, value).ptr - first);
+}
+
+/**
+ * @brief Appends an argument to a buffer. Produces the same text operator<<
+ * would with default stream settings, without going through a stream for
+ * numbers and strings.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ */
+template <typename T>
+void append_argument(Buffer& buffer, const T& argument) {
+    if constexpr (std::is_same_v<T, bool>) {
+        buffer.push_back(argument ? '1' : '0');
+    } else if constexpr (is_character_v<T>) {
+        buffer.push_back(static_cast<char>(argument));
+    } else if constexpr (std::is_integral_v<T>) {
+        append_integer(buffer, argument);
+    } else if constexpr (std::is_floating_point_v<T>) {
+        // Same as the %g default of streams, e.g. "-1.23457e+308"
+        constexpr std::size_t max_size = 32;
+        char* first = buffer.prepare(max_size);
+        buffer.commit(std::to_chars(first, first + max_size, argument,
+                                    std::chars_format::general, 6)
+                          .ptr -
+                      first);
+    } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        buffer.append(std::string_view(argument));
+    } else {
+        thread_local BufferStreambuf streambuf;
+        thread_local std::ostream stream(&streambuf);
+        Buffer* const previous_buffer = streambuf.set_buffer(&buffer);
+        stream.clear();
+        stream.flags(std::ios_base::dec | std::ios_base::skipws);
+        stream.precision(6);
+        stream.width(0);
+        stream.fill(' ');
+        stream << argument;
+        streambuf.set_buffer(previous_buffer);
+    }
+}
+
+/**
+ * @brief Pads the text appended since start to the width of a
+ * specification. Numbers are right aligned and everything else left aligned
+ * by default, zero padding goes after the sign and base prefix.
+ *
+ * @param buffer
+ * @param start
+ * @param spec
+ * @param is_number
+ * @param zero_padding_offset size of the sign and prefix, npos when zero
+ * padding does not apply
+ */
+inline void pad_to_width(Buffer& buffer, std::size_t start,
+                         const FormatSpec& spec, bool is_number,
+                         std::size_t zero_padding_offset) {
+    const std::size_t size = buffer.size() - start;
+    if (spec.width <= size) {
+        return;
+    }
+    const std::size_t padding = spec.width - size;
+    buffer.prepare(padding);
+    char* const text = buffer.data() + start;
+    if (spec.is_zero_padded && spec.align == '\0' &&
+        zero_padding_offset != std::string_view::npos) {
+        std::memmove(text + zero_padding_offset + padding,
+                     text + zero_padding_offset, size - zero_padding_offset);
+        std::memset(text + zero_padding_offset, '0', padding);
+    } else {
+        const char align =
+            spec.align != '\0' ? spec.align : (is_number ? '>' : '<');
+        const std::size_t before =
+            align == '>' ? padding : (align == '^' ? padding / 2 : 0);
+        std::memmove(text + before, text, size);
+        std::memset(text, spec.fill, before);
+        std::memset(text + before + size, spec.fill, padding - before);
+    }
+    buffer.commit(padding);
+}
+
+/**
+ * @brief Appends an integer with the sign, base and prefix of a
+ * specification.
+ *
+ * @tparam T
+ * @param buffer
+ * @param value
+ * @param spec
+ * @return std::size_t size of the sign and prefix
+ */
+template <typename T>
+std::size_t append_integer(Buffer& buffer, T value, const FormatSpec& spec) {
+    // Integers wider than 64 bits, e.g. __int128, keep all their bits;
+    // the lazy ::type keeps std::make_unsigned away from bool
+    using Magnitude = typename std::conditional_t<
+        (sizeof(T) > sizeof(std::uint64_t)), std::make_unsigned<T>,
+        std::type_identity<std::uint64_t>>::type;
+    Magnitude magnitude = static_cast<Magnitude>(value);
+    bool is_negative = false;
+    if constexpr (std::is_signed_v<T>) {
+        is_negative = value < 0;
+        if (is_negative) {
+            magnitude = 0 - magnitude;
+        }
+    }
+
+    const std::size_t start = buffer.size();
+    if (is_negative) {
+        buffer.push_back('-');
+    } else if (spec.sign != '-') {
+        buffer.push_back(spec.sign);
+    }
+    unsigned shift = 0;
+    const char* digits = "0123456789abcdef";
+    switch (spec.type) {
+        case 'X':
+            digits = "0123456789ABCDEF";
+            [[fallthrough]];
+        case 'x':
+            shift = 4;
+            break;
+        case 'o':
+            shift = 3;
+            break;
+        case 'b':
+        case 'B':
+            shift = 1;
+            break;
+    }
+    if (spec.is_alternate && shift != 0 && (shift != 3 || magnitude != 0)) {
+        buffer.push_back('0');
+        if (shift != 3) {
+            buffer.push_back(spec.type);
+        }
+    }
+    const std::size_t prefix_size = buffer.size() - start;
+
+    if (shift == 0) {
+        if constexpr (sizeof(Magnitude) > sizeof(std::uint64_t)) {
+            append_integer(buffer, magnitude);
+        } else {
+            const std::size_t size = digit_count(magnitude);
+            write_digits(buffer.prepare(size) + size, magnitude);
+            buffer.commit(size);
+        }
+        return prefix_size;
+    }
+    std::size_t size = 1;
+    for (Magnitude rest = magnitude >> shift; rest != 0; rest >>= shift) {
+        size++;
+    }
+    char* last = buffer.prepare(size) + size;
+    const Magnitude mask = (Magnitude{1} << shift) - 1;
+    do {
+        *--last = digits[magnitude & mask];
+        magnitude >>= shift;
+    } while (magnitude != 0);
+    buffer.commit(size);
+    return prefix_size;
+}
+
+/**
+ * @brief Appends a floating point number with the sign, notation and
+ * precision of a specification, %g with precision 6 by default like streams.
+ *
+ * @tparam T
+ * @param buffer
+ * @param value
+ * @param spec
+ * @return std::size_t size of the sign, npos for infinity and NaN which are
+ * not zero padded
+ */
+template <typename T>
+std::size_t append_float(Buffer& buffer, T value, const FormatSpec& spec) {
+    std::chars_format format = std::chars_format::general;
+    if (spec.type == 'e' || spec.type == 'E') {
+        format = std::chars_format::scientific;
+    } else if (spec.type == 'f' || spec.type == 'F') {
+        format = std::chars_format::fixed;
+    }
+    const int precision = spec.precision != -1 ? spec.precision : 6;
+
+    const std::size_t start = buffer.size();
+    if (!std::signbit(value) && spec.sign != '-') {
+        buffer.push_back(spec.sign);
+    }
+    // Fixed notation of large numbers takes hundreds of digits
+    std::size_t max_size = 32 + static_cast<std::size_t>(precision);
+    for (;;) {
+        char* first = buffer.prepare(max_size);
+        const std::to_chars_result result =
+            std::to_chars(first, first + max_size, value, format, precision);
+        if (result.ec == std::errc()) {
+            buffer.commit(static_cast<std::size_t>(result.ptr - first));
+            break;
+        }
+        max_size *= 2;
+    }
+    if (spec.type == 'E' || spec.type == 'F' || spec.type == 'G') {
+        char* const text = buffer.data();
+        for (std::size_t index = start; index < buffer.size(); index++) {
+            if (text[index] >= 'a' && text[index] <= 'z') {
+                text[index] = static_cast<char>(text[index] - 'a' + 'A');
+            }
+        }
+    }
+    if (!std::isfinite(value)) {
+        return std::string_view::npos;
+    }
+    return std::signbit(value) || spec.sign != '-' ? 1 : 0;
+}
+
+/**
+ * @brief Appends an argument as a format specification says, checked at
+ * compile time to suit its type.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ * @param spec
+ */
+template <typename T>
+void append_formatted(Buffer& buffer, const T& argument,
+                      const FormatSpec& spec) {
+    if (spec.is_default()) {
+        append_argument(buffer, argument);
+        return;
+    }
+    const std::size_t start = buffer.size();
+    std::size_t zero_padding_offset = std::string_view::npos;
+    bool is_number = false;
+    if constexpr (std::is_integral_v<T>) {
+        if (spec.type == 's') {
+            buffer.append(argument ? "true" : "false");
+        } else if (spec.type == 'c' ||
+                   (spec.type == '\0' && is_character_v<T>)) {
+            buffer.push_back(static_cast<char>(argument));
+        } else if (std::is_same_v<T, bool> && spec.type == '\0') {
+            buffer.push_back(argument ? '1' : '0');
+        } else {
+            zero_padding_offset = append_integer(buffer, argument, spec);
+            is_number = true;
+        }
+    } else if constexpr (std::is_floating_point_v<T>) {
+        zero_padding_offset = append_float(buffer, argument, spec);
+        is_number = true;
+    } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        const std::string_view text(argument);
+        buffer.append(spec.precision != -1
+                          ? text.substr(0, static_cast<std::size_t>(
+                                               spec.precision))
+                          : text);
+    } else {
+        append_argument(buffer, argument);
+    }
+    pad_to_width(buffer, start, spec, is_number, zero_padding_offset);
+}
+
+/**
+ * @brief append_formatted for an argument behind a type-erased pointer.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ * @param spec
+ */
+template <typename T>
+void append_erased(Buffer& buffer, const void* argument,
+                   const FormatSpec& spec) {
+    append_formatted(buffer, *static_cast<const T*>(argument), spec);
+}
+
+/**
+ * @brief The append_erased function of an argument type, null for fields
+ * which placeholders cannot refer to.
+ *
+ * @tparam T
+ * @return void (*)(Buffer&, const void*, const FormatSpec&)
+ */
+template <typename T>
+constexpr auto get_append_function() {
+    using AppendFunction = void (*)(Buffer&, const void*, const FormatSpec&);
+    if constexpr (is_key_value_v<T>) {
+        return AppendFunction(nullptr);
+    } else {
+        return AppendFunction(&append_erased<T>);
+    }
+}
+
+/**
+ * @brief Whether a character has to be escaped in a JSON string.
+ *
+ * @param character
+ * @return true for control characters, quotes and backslashes
+ * @return false otherwise
+ */
+inline bool is_json_escaped(char character) {
+    return static_cast<unsigned char>(character) < 0x20 || character == '"' ||
+           character == '\\';
+}
+
+/**
+ * @brief The number of bytes escaping adds for a character: 1 for short
+ * escapes such as \\n, 5 for \\u00XX and 0 if it is not escaped.
+ *
+ * @param character
+ * @return std::size_t
+ */
+inline std::size_t get_json_escape_size(char character) {
+    switch (character) {
+        case '"':
+        case '\\':
+        case '\b':
+        case '\f':
+        case '\n':
+        case '\r':
+        case '\t':
+            return 1;
+        default:
+            return static_cast<unsigned char>(character) < 0x20 ? 5 : 0;
+    }
+}
+
+/**
+ * @brief Escapes the text appended since start for a JSON string, in place.
+ * Text is checked 16 bytes at a time with SSE2 where available, and left
+ * untouched if nothing needs escaping, the common case.
+ *
+ * @param buffer
+ * @param start
+ */
+inline void escape_json(Buffer& buffer, std::size_t start) {
+    const char* const text = buffer.data();
+    const std::size_t end = buffer.size();
+    std::size_t index = start;
+    std::size_t extra_size = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    const __m128i last_control = _mm_set1_epi8(0x1F);
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    for (; index + 16 <= end; index += 16) {
+        const __m128i block =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + index));
+        // Unsigned block <= 0x1F, as max(block, 0x1F) == 0x1F
+        const __m128i is_escaped = _mm_or_si128(
+            _mm_cmpeq_epi8(_mm_max_epu8(block, last_control), last_control),
+            _mm_or_si128(_mm_cmpeq_epi8(block, quote),
+                         _mm_cmpeq_epi8(block, backslash)));
+        if (_mm_movemask_epi8(is_escaped) == 0) {
+            continue;
+        }
+        for (std::size_t offset = 0; offset < 16; offset++) {
+            extra_size += get_json_escape_size(text[index + offset]);
+        }
+    }
+#endif
+    for (; index < end; index++) {
+        const char character = text[index];
+        extra_size += get_json_escape_size(character);
+    }
+    if (extra_size == 0) {
+        return;
+    }
+
+    // Expand from the back so every character moves only once
+    buffer.prepare(extra_size);
+    char* const data = buffer.data();
+    char* target = data + end + extra_size;
+    for (std::size_t source = end; source-- > start;) {
+        const char character = data[source];
+        if (!is_json_escaped(character)) {
+            *--target = character;
+            continue;
+        }
+        char escape = '\0';
+        switch (character) {
+            case '"':
+                escape = '"';
+                break;
+            case '\\':
+                escape = '\\';
+                break;
+            case '\b':
+                escape = 'b';
+                break;
+            case '\f':
+                escape = 'f';
+                break;
+            case '\n':
+                escape = 'n';
+                break;
+            case '\r':
+                escape = 'r';
+                break;
+            case '\t':
+                escape = 't';
+                break;
+        }
+        if (escape != '\0') {
+            *--target = escape;
+        } else {
+            const unsigned char code = static_cast<unsigned char>(character);
+            *--target = "0123456789abcdef"[code & 0xF];
+            *--target = "0123456789abcdef"[code >> 4];
+            *--target = '0';
+            *--target = '0';
+            *--target = 'u';
+        }
+        *--target = '\\';
+    }
+    buffer.commit(extra_size);
+}
+
+/**
+ * @brief Appends a field value as JSON: numbers and booleans as is,
+ * everything else as an escaped string.
+ *
+ * @tparam T
+ * @param buffer
+ * @param value
+ */
+template <typename T>
+void append_json_value(Buffer& buffer, const T& value) {
+    if constexpr (std::is_same_v<T, bool>) {
+        buffer.append(value ? "true" : "false");
+    } else if constexpr (std::is_integral_v<T> && !is_character_v<T>) {
+        append_integer(buffer, value);
+    } else if constexpr (std::is_floating_point_v<T>) {
+        if (std::isfinite(value)) {
+            append_argument(buffer, value);
+        } else {
+            buffer.append("null");
+        }
+    } else {
+        buffer.push_back('"');
+        const std::size_t start = buffer.size();
+        append_argument(buffer, value);
+        escape_json(buffer, start);
+        buffer.push_back('"');
+    }
+}
+
+/**
+ * @brief Appends " key=value" for a field, nothing for other arguments.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ */
+template <typename T>
+void append_text_field(Buffer& buffer, const T& argument) {
+    if constexpr (is_key_value_v<T>) {
+        buffer.push_back(' ');
+        buffer.append(argument.key);
+        buffer.push_back('=');
+        append_argument(buffer, unwrap_argument(argument.value));
+    }
+}
+
+/**
+ * @brief Appends ,"key":value for a field, nothing for other arguments.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ */
+template <typename T>
+void append_json_field(Buffer& buffer, const T& argument) {
+    if constexpr (is_key_value_v<T>) {
+        buffer.append(",\"");
+        const std::size_t start = buffer.size();
+        buffer.append(argument.key);
+        escape_json(buffer, start);
+        buffer.append("\":");
+        append_json_value(buffer, unwrap_argument(argument.value));
+    }
+}
+
+/**
+ * @brief Reads the CPU timestamp counter and converts its ticks to wall clock
+ * time. The conversion is calibrated against std::chrono::system_clock, first
+ * over a short interval when enabled, then refined about once a second by
+ * whichever thread renders timestamps, the writer thread in asynchronous
+ * mode. Falls back to std::chrono::steady_clock where there is no timestamp
+ * counter.
+ *
+ */
+class TscClock {
+   private:
+    std::mutex calibration_mutex;
+    // Odd while the calibration below is being updated
+    std::atomic<std::uint64_t> calibration_sequence{0};
+    std::atomic<std::uint64_t> base_ticks{0};
+    std::atomic<std::int64_t> base_nanoseconds{0};
+    std::atomic<double> nanoseconds_per_tick{1.0};
+    std::uint64_t first_ticks = 0;
+    std::int64_t first_nanoseconds = 0;
+    std::atomic<std::uint64_t> recalibration_ticks{0};
+
+    /**
+     * @brief Reads the timestamp counter and the system clock at about the
+     * same moment.
+     *
+     * @param ticks
+     * @param nanoseconds
+     */
+    static void sample(std::uint64_t& ticks, std::int64_t& nanoseconds) {
+        const std::uint64_t before = read();
+        nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+        const std::uint64_t after = read();
+        ticks = before + (after - before) / 2;
+    }
+
+    /**
+     * @brief Publishes a new calibration, calibration_mutex must be held.
+     *
+     * @param ticks
+     * @param nanoseconds
+     * @param rate nanoseconds per tick
+     */
+    void publish(std::uint64_t ticks, std::int64_t nanoseconds, double rate) {
+        calibration_sequence.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        base_ticks.store(ticks, std::memory_order_relaxed);
+        base_nanoseconds.store(nanoseconds, std::memory_order_relaxed);
+        nanoseconds_per_tick.store(rate, std::memory_order_relaxed);
+        calibration_sequence.fetch_add(1, std::memory_order_release);
+        // Refine again once about a second has passed
+        recalibration_ticks.store(ticks + static_cast<std::uint64_t>(1e9 / rate),
+                                  std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Refines the tick rate over the whole time since calibrate, and
+     * moves the base to now so drift does not accumulate.
+     *
+     */
+    void recalibrate() {
+        std::unique_lock<std::mutex> lock(calibration_mutex, std::try_to_lock);
+        if (!lock.owns_lock() ||
+            read() < recalibration_ticks.load(std::memory_order_relaxed)) {
+            return;
+        }
+        std::uint64_t ticks;
+        std::int64_t nanoseconds;
+        sample(ticks, nanoseconds);
+        if (ticks > first_ticks && nanoseconds > first_nanoseconds) {
+            publish(ticks, nanoseconds,
+                    static_cast<double>(nanoseconds - first_nanoseconds) /
+                        static_cast<double>(ticks - first_ticks));
+        }
+    }
+
+   public:
+    /**
+     * @brief Reads the timestamp counter.
+     *
+     * @return std::uint64_t
+     */
+    static std::uint64_t read() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || \
+    defined(_M_IX86)
+        return __rdtsc();
+#else
+        return static_cast<std::uint64_t>(
+            std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    /**
+     * @brief Measures the tick rate over a short interval, blocking the
+     * calling thread for about 10 milliseconds.
+     *
+     */
+    void calibrate() {
+        std::lock_guard<std::mutex> lock(calibration_mutex);
+        sample(first_ticks, first_nanoseconds);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::uint64_t ticks;
+        std::int64_t nanoseconds;
+        sample(ticks, nanoseconds);
+        publish(ticks, nanoseconds,
+                static_cast<double>(nanoseconds - first_nanoseconds) /
+                    static_cast<double>(ticks - first_ticks));
+    }
+
+    /**
+     * @brief Converts ticks returned by read to wall clock time.
+     *
+     * @param ticks
+     * @return std::chrono::system_clock::time_point
+     */
+    std::chrono::system_clock::time_point to_time_point(std::uint64_t ticks) {
+        if (ticks >= recalibration_ticks.load(std::memory_order_relaxed)) {
+            recalibrate();
+        }
+        std::uint64_t sequence;
+        std::uint64_t base;
+        std::int64_t nanoseconds;
+        double rate;
+        do {
+            sequence = calibration_sequence.load(std::memory_order_acquire);
+            base = base_ticks.load(std::memory_order_relaxed);
+            nanoseconds = base_nanoseconds.load(std::memory_order_relaxed);
+            rate = nanoseconds_per_tick.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while ((sequence & 1) ||
+                 sequence !=
+                     calibration_sequence.load(std::memory_order_relaxed));
+
+        const double elapsed =
+            ticks >= base ? static_cast<double>(ticks - base) * rate
+                          : -static_cast<double>(base - ticks) * rate;
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(nanoseconds +
+                                         static_cast<std::int64_t>(elapsed))));
+    }
+};
+
+/**
+ * @brief Per thread cache of the formatted timestamp. The datetime format is
+ * only run through strftime when the second changes, and the local time is
+ * only computed (thread-safely) when the minute changes, other seconds reuse
+ * the broken-down time of their minute. Sub-second fields (%3N milliseconds,
+ * %6N microseconds, %9N or %N nanoseconds) are patched into the cached text
+ * on every call.
+ *
+ */
+class TimestampCache {
+   private:
+    /**
+     * @brief Part of the datetime format handed to strftime, followed by a
+     * sub-second field of the given number of digits, if any.
+     *
+     */
+    struct Piece {
+        std::string strftime_format;
+        int subsecond_digits;
+    };
+
+    /**
+     * @brief Where a sub-second field sits in the cached text.
+     *
+     */
+    struct Field {
+        std::size_t offset;
+        int digits;
+    };
+
+    std::vector<Piece> pieces;
+    std::vector<Field> fields;
+    std::time_t cached_second = std::numeric_limits<std::time_t>::min();
+    std::time_t cached_minute = std::numeric_limits<std::time_t>::min();
+    std::uint64_t cached_generation = 0;
+    std::tm minute_time{};
+    char text[256];
+    std::size_t length = 0;
+
+    /**
+     * @brief Splits the datetime format around its sub-second fields.
+     *
+     * @param datetime_format
+     */
+    void parse(const char* datetime_format) {
+        pieces.clear();
+        std::string current;
+        for (std::size_t index = 0; datetime_format[index] != '\0'; index++) {
+            const char* specifier = datetime_format + index;
+            int digits = 0;
+            if (specifier[0] == '%' && specifier[1] == 'N') {
+                digits = 9;
+                index += 1;
+            } else if (specifier[0] == '%' && specifier[1] >= '1' &&
+                       specifier[1] <= '9' && specifier[2] == 'N') {
+                digits = specifier[1] - '0';
+                index += 2;
+            } else if (specifier[0] == '%' && specifier[1] != '\0') {
+                current += specifier[0];
+                current += specifier[1];
+                index += 1;
+                continue;
+            } else {
+                current += specifier[0];
+                continue;
+            }
+            pieces.push_back(Piece{current, digits});
+            current.clear();
+        }
+        pieces.push_back(Piece{current, 0});
+    }
+
+   public:
+    /**
+     * @brief Formats a time point, reusing the previous result within the
+     * same second.
+     *
+     * @param time
+     * @param datetime_format
+     * @param generation changes whenever datetime_format does
+     * @return std::string_view valid until the next call
+     */
+    std::string_view format(std::chrono::system_clock::time_point time,
+                            const char* datetime_format,
+                            std::uint64_t generation) {
+        const std::time_t second = std::chrono::system_clock::to_time_t(time);
+        if (generation != cached_generation) {
+            parse(datetime_format);
+            cached_second = std::numeric_limits<std::time_t>::min();
+            cached_generation = generation;
+        }
+
+        if (second != cached_second) {
+            const std::time_t minute = second / 60;
+            if (minute != cached_minute) {
+#if defined(_WIN32)
+                localtime_s(&minute_time, &second);
+#else
+                localtime_r(&second, &minute_time);
+#endif
+                minute_time.tm_sec -= static_cast<int>(second % 60);
+                cached_minute = minute;
+            }
+            std::tm local_time = minute_time;
+            local_time.tm_sec += static_cast<int>(second % 60);
+
+            length = 0;
+            fields.clear();
+            for (const Piece& piece : pieces) {
+                length += std::strftime(text + length, sizeof(text) - length,
+                                        piece.strftime_format.c_str(),
+                                        &local_time);
+                if (piece.subsecond_digits > 0 &&
+                    length + piece.subsecond_digits <= sizeof(text)) {
+                    fields.push_back(Field{length, piece.subsecond_digits});
+                    length += piece.subsecond_digits;
+                }
+            }
+            cached_second = second;
+        }
+
+        if (!fields.empty()) {
+            const auto since_second =
+                time - std::chrono::system_clock::from_time_t(second);
+            const auto nanoseconds = static_cast<std::uint32_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    since_second)
+                    .count());
+            for (const Field& field : fields) {
+                std::uint32_t value = nanoseconds;
+                for (int digit = field.digits; digit < 9; digit++) {
+                    value /= 10;
+                }
+                for (int digit = field.digits - 1; digit >= 0; digit--) {
+                    text[field.offset + digit] =
+                        static_cast<char>('0' + value % 10);
+                    value /= 10;
+                }
+            }
+        }
+        return std::string_view(text, length);
+    }
+};
+
+/**
+ * @brief The thread a message is logged from.
+ *
+ */
+struct ThreadInfo {
+    // The OS thread ID where there is one, e.g. as shown by top
+    std::uint64_t id = 0;
+    // The thread name if set, else its ID, rendered once. Owned by the
+    // thread, deferred records carry a copy.
+    std::string_view text;
+};
+
+/**
+ * @brief The calling thread's ThreadInfo and the text it refers to, only
+ * changed by the thread itself.
+ *
+ */
+struct CurrentThread {
+    ThreadInfo info;
+    std::string text;
+
+    CurrentThread() {
+#if defined(__linux__)
+        info.id = static_cast<std::uint64_t>(::syscall(SYS_gettid));
+#else
+        info.id = static_cast<std::uint64_t>(
+            std::hash<std::thread::id>()(std::this_thread::get_id()));
+#endif
+        set_text(std::to_string(info.id));
+    }
+
+    CurrentThread(const CurrentThread&) = delete;
+    CurrentThread& operator=(const CurrentThread&) = delete;
+
+    void set_text(std::string_view new_text) {
+        text.assign(new_text);
+        info.text = text;
+    }
+};
+
+/**
+ * @brief The calling thread, looked up and rendered once per thread.
+ *
+ * @return CurrentThread&
+ */
+inline CurrentThread& current_thread_state() {
+    thread_local CurrentThread thread;
+    return thread;
+}
+
+/**
+ * @brief The calling thread. Its text is only valid on this thread and until
+ * it is renamed.
+ *
+ * @return const ThreadInfo&
+ */
+inline const ThreadInfo& current_thread() {
+    return current_thread_state().info;
+}
+
+/**
+ * @brief A pattern layout compiled into the steps writing a message, see
+ * Logger::set_pattern. Kept per formatting thread and compiled again only
+ * when the pattern changes, so a call just runs the steps.
+ *
+ */
+class PatternLayout {
+   public:
+    enum class StepKind : std::uint8_t {
+        Literal,
+        Level,     // %L
+        Time,      // %T, with the datetime format
+        Thread,    // %t
+        File,      // %s
+        Line,      // %#
+        Function,  // %f
+        Message,   // %v, with the fields
+    };
+
+    struct Step {
+        StepKind kind;
+        std::string text;  // Of literals
+    };
+
+   private:
+    std::vector<Step> steps;
+    // Index of the message step, steps.size() if there is none
+    std::size_t message_step = 0;
+    std::uint64_t cached_generation = 0;
+
+    void compile(const char* pattern) {
+        steps.clear();
+        const auto add_literal = [&](std::string_view text) {
+            if (steps.empty() || steps.back().kind != StepKind::Literal) {
+                steps.push_back({StepKind::Literal, {}});
+            }
+            steps.back().text.append(text);
+        };
+
+        for (const char* cursor = pattern; *cursor != '\0'; cursor++) {
+            if (cursor[0] != '%' || cursor[1] == '\0') {
+                add_literal(std::string_view(cursor, 1));
+                continue;
+            }
+            StepKind kind;
+            switch (*++cursor) {
+                case 'L':
+                    kind = StepKind::Level;
+                    break;
+                case 'T':
+                    kind = StepKind::Time;
+                    break;
+                case 't':
+                    kind = StepKind::Thread;
+                    break;
+                case 's':
+                    kind = StepKind::File;
+                    break;
+                case '#':
+                    kind = StepKind::Line;
+                    break;
+                case 'f':
+                    kind = StepKind::Function;
+                    break;
+                case 'v':
+                    kind = StepKind::Message;
+                    break;
+                case '%':
+                    add_literal("%");
+                    continue;
+                default:
+                    add_literal(std::string_view(cursor - 1, 2));
+                    continue;
+            }
+            steps.push_back({kind, {}});
+        }
+
+        message_step = static_cast<std::size_t>(
+            std::find_if(steps.begin(), steps.end(),
+                         [](const Step& step) {
+                             return step.kind == StepKind::Message;
+                         }) -
+            steps.begin());
+    }
+
+   public:
+    /**
+     * @brief Compiles the pattern if it changed since the last call.
+     *
+     * @param pattern
+     * @param generation changes whenever the pattern does
+     */
+    void update(const char* pattern, std::uint64_t generation) {
+        if (generation != cached_generation) {
+            compile(pattern);
+            cached_generation = generation;
+        }
+    }
+
+    /**
+     * @brief The steps before the message.
+     *
+     * @return std::span<const Step>
+     */
+    std::span<const Step> get_head() const {
+        return std::span<const Step>(steps).first(message_step);
+    }
+
+    /**
+     * @brief The steps after the message.
+     *
+     * @return std::span<const Step>
+     */
+    std::span<const Step> get_tail() const {
+        return std::span<const Step>(steps).subspan(
+            std::min(message_step + 1, steps.size()));
+    }
+
+    /**
+     * @brief Whether the pattern has a message step.
+     *
+     * @return true if it has
+     * @return false otherwise
+     */
+    bool has_message() const { return message_step != steps.size(); }
+};
+
+/**
+ * @brief Strings captured by deferred formatting, their characters are copied
+ * into the record.
+ *
+ * @tparam T
+ */
+template <typename T>
+inline constexpr bool is_deferred_string_v =
+    std::is_same_v<T, const char*> || std::is_same_v<T, char*> ||
+    std::is_same_v<T, std::string_view> || std::is_same_v<T, std::string>;
+
+/**
+ * @brief Pointers operator<< prints as C strings, e.g. unsigned char*. Their
+ * bytes would only be read on the writer thread, when the characters they
+ * point to may be gone.
+ *
+ * @tparam T
+ */
+template <typename T>
+inline constexpr bool is_character_pointer_v =
+    std::is_pointer_v<T> &&
+    is_character_v<std::remove_cv_t<std::remove_pointer_t<T>>>;
+
+/**
+ * @brief Types whose formatting can be deferred to the writer thread, i.e.
+ * strings and anything that can be captured by copying its bytes, except
+ * character pointers other than the strings.
+ *
+ * @tparam T
+ */
+template <typename T>
+inline constexpr bool is_deferrable_v =
+    is_deferred_string_v<T> ||
+    (std::is_trivially_copyable_v<T> && !is_character_pointer_v<T>);
+
+template <typename T>
+inline constexpr bool is_deferrable_v<KeyValue<T>> = is_deferrable_v<T>;
+
+/**
+ * @brief Type an argument is captured as by deferred formatting, e.g. string
+ * literals are captured as const char*, named arguments as their value and
+ * fields as their key and captured value.
+ *
+ * @tparam T
+ */
+template <typename T>
+struct DeferredType {
+    using type = std::decay_t<const unwrapped_t<T>&>;
+};
+
+template <typename T>
+using deferred_t = typename DeferredType<T>::type;
+
+template <typename T>
+struct DeferredType<KeyValue<T>> {
+    using type = KeyValue<deferred_t<T>>;
+};
+
+/**
+ * @brief Appends the raw bytes of an argument to an encoded record. Strings
+ * are stored as their size followed by their characters.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ */
+template <typename T>
+void encode_argument(std::string& buffer, const T& argument) {
+    if constexpr (is_deferred_string_v<T>) {
+        const std::string_view text(argument);
+        const std::size_t size = text.size();
+        buffer.append(reinterpret_cast<const char*>(&size), sizeof(size));
+        buffer.append(text);
+    } else {
+        buffer.append(reinterpret_cast<const char*>(&argument), sizeof(T));
+    }
+}
+
+/**
+ * @brief Encodes an argument as its deferred_t.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ */
+template <typename T>
+void encode_deferred(std::string& buffer, const T& argument) {
+    if constexpr (is_key_value_v<T>) {
+        encode_argument<std::string_view>(buffer, argument.key);
+        encode_deferred(buffer, argument.value);
+    } else {
+        encode_argument<deferred_t<T>>(buffer, unwrap_argument(argument));
+    }
+}
+
+/**
+ * @brief What a deferred record carries of the format object passed to a
+ * logging function: the literal, which lives as long as the program, and the
+ * location of the call. The writer thread rebuilds the rest, see
+ * get_checked_format.
+ *
+ */
+struct DeferredFormat {
+    const char* literal;
+    SourceLocation location;
+};
+
+/**
+ * @brief The format object of a literal checked at compile time, rebuilt
+ * the first time the calling thread sees the literal and kept for later
+ * messages. Its location is whatever was last set.
+ *
+ * @tparam Format
+ * @param literal
+ * @return Format&
+ */
+template <typename Format>
+Format& get_checked_format(const char* literal) {
+    thread_local std::unordered_map<const char*, Format> formats;
+    auto found = formats.find(literal);
+    if (found == formats.end()) {
+        found =
+            formats.emplace(literal, Format::from_checked_literal(literal))
+                .first;
+    }
+    return found->second;
+}
+
+/**
+ * @brief An argument read back from an encoded record by the writer thread.
+ *
+ * @tparam T
+ */
+template <typename T, bool = is_deferred_string_v<T>>
+class DecodedArgument {
+   private:
+    alignas(T) unsigned char storage[sizeof(T)];
+
+   public:
+    explicit DecodedArgument(const char*& cursor) {
+        std::memcpy(storage, cursor, sizeof(T));
+        cursor += sizeof(T);
+    }
+
+    const T& get() const {
+        return *std::launder(reinterpret_cast<const T*>(storage));
+    }
+};
+
+/**
+ * @brief Strings are read back as views into the encoded record.
+ *
+ * @tparam T
+ */
+template <typename T>
+class DecodedArgument<T, true> {
+   private:
+    std::string_view text;
+
+   public:
+    explicit DecodedArgument(const char*& cursor) {
+        std::size_t size;
+        std::memcpy(&size, cursor, sizeof(size));
+        cursor += sizeof(size);
+        text = std::string_view(cursor, size);
+        cursor += size;
+    }
+
+    std::string_view get() const { return text; }
+};
+
+/**
+ * @brief Fields are read back as their key and value, the field refers to
+ * the value held here.
+ *
+ * @tparam T
+ */
+template <typename T>
+class DecodedArgument<KeyValue<T>, false> {
+   private:
+    using Value = std::remove_cvref_t<
+        decltype(std::declval<DecodedArgument<T>>().get())>;
+
+    std::string_view key;
+    Value value;
+
+   public:
+    explicit DecodedArgument(const char*& cursor)
+        : key(DecodedArgument<std::string_view>(cursor).get()),
+          value(DecodedArgument<T>(cursor).get()) {}
+
+    KeyValue<Value> get() const { return {key, value}; }
+};
+
+/**
+ * @brief The call sites of the program, filled during static initialization.
+ * IDs start at 1, so 0 can mean no call site.
+ *
+ */
+class CallSiteRegistry {
+   private:
+    static std::mutex& get_mutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    static std::vector<CallSite>& get_call_sites() {
+        static std::vector<CallSite> call_sites;
+        return call_sites;
+    }
+
+   public:
+    static std::uint32_t add(const CallSite& call_site) {
+        std::lock_guard<std::mutex> lock(get_mutex());
+        get_call_sites().push_back(call_site);
+        return static_cast<std::uint32_t>(get_call_sites().size());
+    }
+
+    static std::vector<CallSite> get_all() {
+        std::lock_guard<std::mutex> lock(get_mutex());
+        return get_call_sites();
+    }
+};
+
+/**
+ * @brief ID of a call site. Site is the type of a lambda returning the
+ * CallSite, unique to every expansion of HERRLOG_CALL_SITE. Being a
+ * namespace scope variable, it is initialized with the other statics before
+ * main, not on the first call.
+ *
+ * @tparam Site
+ */
+template <typename Site>
+inline const std::uint32_t call_site_id = CallSiteRegistry::add(Site{}());
+
+/**
+ * @brief The format string of a call site, a constant rather than an object
+ * passed to every call.
+ *
+ * @tparam Site
+ * @tparam Format
+ */
+template <typename Site, typename Format>
+inline constexpr Format site_format_v{Site{}().format, Site{}().location};
+
+/**
+ * @brief Type of an argument in the binary log format. Arguments of other
+ * types are written as the text they format to.
+ *
+ */
+enum class BinaryType : std::uint8_t {
+    Bool,
+    Char,
+    Int8,
+    UInt8,
+    Int16,
+    UInt16,
+    Int32,
+    UInt32,
+    Int64,
+    UInt64,
+    Float,
+    Double,
+    String,
+};
+
+// Set on the type of an argument that is a field, see kv
+inline constexpr std::uint8_t binary_field_flag = 0x80;
+
+/**
+ * @brief The binary type an argument of type T is written as.
+ *
+ * @tparam T
+ * @return BinaryType
+ */
+template <typename T>
+constexpr BinaryType get_binary_type() {
+    if constexpr (is_key_value_v<T>) {
+        return get_binary_type<
+            std::remove_cvref_t<decltype(std::declval<T>().value)>>();
+    } else if constexpr (std::is_same_v<T, bool>) {
+        return BinaryType::Bool;
+    } else if constexpr (std::is_same_v<T, char>) {
+        return BinaryType::Char;
+    } else if constexpr (std::is_same_v<T, signed char>) {
+        return BinaryType::Int8;
+    } else if constexpr (std::is_same_v<T, unsigned char>) {
+        return BinaryType::UInt8;
+    } else if constexpr (std::is_integral_v<T> && !is_character_v<T> &&
+                         sizeof(T) <= 8) {
+        constexpr bool is_signed = std::is_signed_v<T>;
+        if constexpr (sizeof(T) == 1) {
+            return is_signed ? BinaryType::Int8 : BinaryType::UInt8;
+        } else if constexpr (sizeof(T) == 2) {
+            return is_signed ? BinaryType::Int16 : BinaryType::UInt16;
+        } else if constexpr (sizeof(T) == 4) {
+            return is_signed ? BinaryType::Int32 : BinaryType::UInt32;
+        } else {
+            return is_signed ? BinaryType::Int64 : BinaryType::UInt64;
+        }
+    } else if constexpr (std::is_same_v<T, float>) {
+        return BinaryType::Float;
+    } else if constexpr (std::is_floating_point_v<T>) {
+        return BinaryType::Double;
+    } else {
+        return BinaryType::String;
+    }
+}
+
+/**
+ * @brief Appends an unsigned LEB128 varint, 7 bits per byte.
+ *
+ * @param buffer
+ * @param value
+ */
+inline void append_varint(Buffer& buffer, std::uint64_t value) {
+    char* const start = buffer.prepare(10);
+    char* cursor = start;
+    while (value >= 0x80) {
+        *cursor++ = static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *cursor++ = static_cast<char>(value);
+    buffer.commit(static_cast<std::size_t>(cursor - start));
+}
+
+/**
+ * @brief Maps signed values to unsigned ones so small magnitudes of either
+ * sign make short varints.
+ *
+ * @param value
+ * @return std::uint64_t
+ */
+inline std::uint64_t zigzag_encode(std::int64_t value) {
+    return (static_cast<std::uint64_t>(value) << 1) ^
+           static_cast<std::uint64_t>(value >> 63);
+}
+
+/**
+ * @brief Appends a string preceded by its size as a varint.
+ *
+ * @param buffer
+ * @param text
+ */
+inline void append_binary_string(Buffer& buffer, std::string_view text) {
+    append_varint(buffer, text.size());
+    buffer.append(text);
+}
+
+/**
+ * @brief Appends an argument in the binary log format: numbers as their raw
+ * bytes, strings and everything else as sized text. A field is written as
+ * its key followed by its value.
+ *
+ * @tparam T
+ * @param buffer
+ * @param argument
+ */
+template <typename T>
+void append_binary_argument(Buffer& buffer, const T& argument) {
+    constexpr BinaryType type = get_binary_type<T>();
+    if constexpr (is_key_value_v<T>) {
+        append_binary_string(buffer, argument.key);
+        append_binary_argument(buffer, unwrap_argument(argument.value));
+    } else if constexpr (type == BinaryType::Double) {
+        const double value = static_cast<double>(argument);
+        buffer.append(std::string_view(reinterpret_cast<const char*>(&value),
+                                       sizeof(value)));
+    } else if constexpr (type != BinaryType::String) {
+        buffer.append(std::string_view(
+            reinterpret_cast<const char*>(&argument), sizeof(T)));
+    } else if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+        append_binary_string(buffer, std::string_view(argument));
+    } else {
+        // The size is only known once formatted, so reserve one byte for it
+        // and move the text if its size takes more
+        const std::size_t start = buffer.size();
+        buffer.push_back('\0');
+        append_argument(buffer, argument);
+        const std::size_t size = buffer.size() - start - 1;
+        std::size_t size_length = 1;
+        while (size >> (7 * size_length) != 0) {
+            size_length++;
+        }
+        if (size_length > 1) {
+            buffer.prepare(size_length - 1);
+            std::memmove(buffer.data() + start + size_length,
+                         buffer.data() + start + 1, size);
+        }
+        char* cursor = buffer.data() + start;
+        for (std::size_t index = 0; index + 1 < size_length; index++) {
+            *cursor++ = static_cast<char>(((size >> (7 * index)) & 0x7F) | 0x80);
+        }
+        *cursor = static_cast<char>(size >> (7 * (size_length - 1)));
+        buffer.commit(size_length - 1);
+    }
+}
+
+/**
+ * @brief What the binary log format needs to know about a format string and
+ * the types of its arguments. There is one per instantiation of log, see
+ * binary_format_v.
+ *
+ */
+struct BinaryFormat {
+    // Size of the format literal pointer in front of the arguments, 0 for
+    // call sites
+    std::size_t format_size;
+    // Format string literal, the data of the message passed
+    const char* (*get_literal)(const char* data);
+    // Appends the definition of the format string to a file's string table
+    void (*describe)(Buffer& buffer, const char* format);
+    // ID of the call site, null when logged without one
+    const std::uint32_t* call_site_id;
+};
+
+/**
+ * @brief Appends the definition of a format string: the types of the
+ * arguments, the argument and specification of every placeholder and the
+ * literal segments, see BinaryFileSink.
+ *
+ * @tparam Format
+ * @tparam Args
+ * @param buffer
+ * @param format
+ */
+template <typename Format, typename... Args>
+void describe_binary_format(Buffer& buffer, const Format& format) {
+    append_varint(buffer, sizeof...(Args));
+    (buffer.push_back(static_cast<char>(
+         static_cast<std::uint8_t>(get_binary_type<Args>()) |
+         (is_key_value_v<Args> ? binary_field_flag : 0))),
+     ...);
+    append_varint(buffer, format.placeholder_count);
+    for (std::size_t index = 0; index < format.placeholder_count; index++) {
+        const FormatSpec& spec = format.specs[index];
+        append_varint(buffer, format.argument_indexes[index]);
+        buffer.push_back(spec.fill);
+        buffer.push_back(spec.align);
+        buffer.push_back(spec.sign);
+        buffer.push_back(spec.type);
+        buffer.push_back(static_cast<char>(spec.is_alternate |
+                                           (spec.is_zero_padded << 1)));
+        append_varint(buffer, spec.width);
+        append_varint(buffer, zigzag_encode(spec.precision));
+    }
+    Buffer segment;
+    for (std::size_t index = 0; index <= format.placeholder_count; index++) {
+        segment.clear();
+        append_segment(segment, format, index);
+        append_binary_string(buffer, segment.view());
+    }
+}
+
+/**
+ * @brief The format literal pointer at the start of a binary message logged
+ * without a call site.
+ *
+ * @param data
+ * @return const char*
+ */
+inline const char* read_format_literal(const char* data) {
+    const char* literal;
+    std::memcpy(&literal, data, sizeof(literal));
+    return literal;
+}
+
+/**
+ * @brief The BinaryFormat of a format string. Messages logged without a call
+ * site (Site void) carry the pointer to the format literal, the writer thread
+ * rebuilds the format from it. Those of a call site carry nothing, the format
+ * is a constant.
+ *
+ * @tparam Site
+ * @tparam Format
+ * @tparam Args
+ */
+template <typename Site, typename Format, typename... Args>
+inline constexpr BinaryFormat binary_format_v{
+    std::is_void_v<Site> ? sizeof(const char*) : 0,
+    [](const char* data) {
+        if constexpr (std::is_void_v<Site>) {
+            return read_format_literal(data);
+        } else {
+            return site_format_v<Site, Format>.literal;
+        }
+    },
+    [](Buffer& buffer, const char* data) {
+        if constexpr (std::is_void_v<Site>) {
+            describe_binary_format<Format, Args...>(
+                buffer, get_checked_format<Format>(read_format_literal(data)));
+        } else {
+            describe_binary_format<Format, Args...>(
+                buffer, site_format_v<Site, Format>);
+        }
+    },
+    [] {
+        if constexpr (std::is_void_v<Site>) {
+            return static_cast<const std::uint32_t*>(nullptr);
+        } else {
+            return &call_site_id<Site>;
+        }
+    }(),
+};
+
+/**
+ * @brief Capacity a record gets before it carries its first message, enough
+ * for a message in the inline capacity of Buffer or for a deferred message's
+ * arguments. Records are swapped through the rings, not
+ * copied, so without it a record sized by a short message would grow again
+ * on the logging thread that next gets it.
+ *
+ */
+inline constexpr std::size_t reserved_record_size = 512;
+
+/**
+ * @brief A message travelling from a logging thread to the writer thread.
+ * Holds either the fully formatted message, or with deferred formatting the
+ * encoded arguments and everything needed to format them later.
+ *
+ */
+struct AsyncRecord {
+    std::string data;  // Formatted message or encoded arguments
+    const char* name = nullptr;
+    std::string_view color;
+    LogType type = LogType::None;
+    // Size of the "[NAME time]" prefix when data is already formatted
+    std::size_t prefix_size = 0;
+    // Formats the message from the encoded arguments and returns its prefix
+    // size, null when data is already formatted
+    std::size_t (*format_message)(Buffer& buffer, const char* name,
+                                  std::uint64_t timestamp,
+                                  const ThreadInfo& thread,
+                                  const char* arguments) = nullptr;
+    // Format string of a message in the binary log format, whose data is
+    // the format literal pointer followed by the binary arguments
+    const BinaryFormat* binary_format = nullptr;
+    std::uint64_t timestamp;  // See Logger::read_clock
+    // Thread ID of deferred messages, whose data ends with the thread text
+    std::uint64_t thread_id = 0;
+    std::size_t thread_text_size = 0;
+};
+
+/**
+ * @brief Queue of records between the logging threads and the writer thread
+ * of the asynchronous backend. Every logging thread gets its own ring (a
+ * shard), so producers never contend with each other. The writer merges the
+ * shards in timestamp order.
+ *
+ */
+class AsyncQueue {
+   private:
+    static constexpr std::size_t max_batch_size = 256;
+
+    /**
+     * @brief Ring of a single logging thread.
+     *
+     */
+    struct Shard {
+        // Every record is reserved, as the logging thread gets back the
+        // record of the slot it pushes into
+        explicit Shard(std::size_t capacity)
+            : ring(capacity, [](AsyncRecord& record) {
+                  record.data.reserve(reserved_record_size);
+              }) {
+            evicted.data.reserve(reserved_record_size);
+        }
+
+        BoundedQueue<AsyncRecord> ring;
+        // Receives the record DropOldest evicts, the slot gets this one's
+        // buffer instead of an empty one. Only used by the owning thread.
+        AsyncRecord evicted;
+        // Set once the owning thread has exited, the shard is then removed
+        // as soon as it is empty
+        std::atomic<bool> is_orphaned{false};
+        // Messages the overflow policy discarded, per shard so that logging
+        // threads dropping at once do not write the same cache line
+        std::atomic<std::uint64_t> dropped_count{0};
+    };
+
+    /**
+     * @brief A thread's handle on its shard, orphans it when the thread
+     * exits.
+     *
+     */
+    struct ShardHandle {
+        std::uint64_t queue_id = 0;
+        std::shared_ptr<Shard> shard;
+
+        ~ShardHandle() {
+            if (shard) {
+                shard->is_orphaned.store(true);
+            }
+        }
+    };
+
+    const std::uint64_t id;
+    const std::size_t shard_capacity;
+    std::mutex shards_mutex;
+    std::vector<std::shared_ptr<Shard>> shards;
+    std::atomic<std::uint64_t> shards_generation{0};
+    // Messages dropped by removed shards, guarded by shards_mutex
+    std::uint64_t removed_dropped_count = 0;
+    // Odd while the writer holds popped messages that are not yet written
+    std::atomic<std::uint64_t> batch_epoch{0};
+    std::atomic<bool> is_writer_sleeping{false};
+    std::mutex wake_mutex;
+    std::condition_variable wake_condition;
+
+    // Only used by the writer thread
+    std::vector<std::shared_ptr<Shard>> writer_shards;
+    std::uint64_t writer_shards_generation = 0;
+    std::vector<AsyncRecord> heads;
+    std::vector<bool> has_head;
+
+    /**
+     * @brief Grows the writer's records. They are swapped into the rings and
+     * end up with the logging threads, so they get reserved_record_size up
+     * front instead of allocating on a logging thread the first time a batch
+     * is that large.
+     *
+     * @param records
+     * @param size
+     */
+    static void grow_records(std::vector<AsyncRecord>& records,
+                             std::size_t size) {
+        if (records.size() >= size) {
+            return;
+        }
+        const std::size_t previous_size = records.size();
+        records.resize(size);
+        for (std::size_t index = previous_size; index < size; index++) {
+            records[index].data.reserve(reserved_record_size);
+        }
+    }
+
+    /**
+     * @brief Unique id of every queue, so a thread notices its shard belongs
+     * to a queue that was since replaced.
+     *
+     * @return std::uint64_t
+     */
+    static std::uint64_t next_id() {
+        static std::atomic<std::uint64_t> last_id{0};
+        return last_id.fetch_add(1) + 1;
+    }
+
+    /**
+     * @brief The calling thread's shard, registered on first use.
+     *
+     * @return Shard&
+     */
+    Shard& thread_shard() {
+        thread_local ShardHandle handle;
+        if (handle.queue_id != id) {
+            if (handle.shard) {
+                handle.shard->is_orphaned.store(true);
+            }
+            handle.shard = std::make_shared<Shard>(shard_capacity);
+            handle.queue_id = id;
+            std::lock_guard<std::mutex> lock(shards_mutex);
+            shards.push_back(handle.shard);
+            shards_generation.fetch_add(1);
+        }
+        return *handle.shard;
+    }
+
+    /**
+     * @brief Updates the writer's copy of the shard list, dropping shards of
+     * exited threads once they are empty.
+     *
+     */
+    void refresh_writer_shards() {
+        bool has_finished_shard = false;
+        for (const std::shared_ptr<Shard>& shard : writer_shards) {
+            if (shard->is_orphaned.load() &&
+                shard->ring.popped_count() == shard->ring.pushed_count()) {
+                has_finished_shard = true;
+            }
+        }
+        if (!has_finished_shard &&
+            shards_generation.load() == writer_shards_generation) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        std::erase_if(shards, [this](const std::shared_ptr<Shard>& shard) {
+            if (!shard->is_orphaned.load() ||
+                shard->ring.popped_count() != shard->ring.pushed_count()) {
+                return false;
+            }
+            removed_dropped_count += shard->dropped_count.load();
+            return true;
+        });
+        writer_shards = shards;
+        writer_shards_generation = shards_generation.load();
+    }
+
+   public:
+    /**
+     * @brief Construct a new Async Queue object
+     *
+     * @param shard_capacity capacity of the ring of each logging thread
+     */
+    explicit AsyncQueue(std::size_t shard_capacity)
+        : id(next_id()), shard_capacity(shard_capacity) {}
+
+    /**
+     * @brief Queues a record on the calling thread's shard, applying the
+     * overflow policy if full. On return record holds a recycled buffer.
+     *
+     * @param record
+     * @param policy
+     */
+    void push(AsyncRecord& record, OverflowPolicy policy) {
+        Shard& shard = thread_shard();
+        BoundedQueue<AsyncRecord>& ring = shard.ring;
+        while (!ring.try_push(record)) {
+            if (policy == OverflowPolicy::DropNewest) {
+                shard.dropped_count.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            if (policy == OverflowPolicy::DropOldest) {
+                if (ring.try_pop(shard.evicted)) {
+                    shard.dropped_count.fetch_add(1,
+                                                  std::memory_order_relaxed);
+                }
+                continue;
+            }
+            wake();
+            std::this_thread::yield();
+        }
+        if (is_writer_sleeping.load()) {
+            wake();
+        }
+    }
+
+    /**
+     * @brief Pops a batch of records, oldest first across all shards, and
+     * hands them to write. Only called from the writer thread.
+     *
+     * @tparam Writer
+     * @param batch scratch records reused between calls
+     * @param write
+     * @return true if any record was written
+     * @return false if the queue was empty
+     */
+    template <typename Writer>
+    bool drain(std::vector<AsyncRecord>& batch, Writer&& write) {
+        batch_epoch.fetch_add(1);
+        refresh_writer_shards();
+        const std::size_t shard_count = writer_shards.size();
+        // Every shard may still hold a head once the batch is full
+        grow_records(batch, max_batch_size + shard_count);
+        grow_records(heads, shard_count);
+        has_head.assign(shard_count, false);
+        for (std::size_t index = 0; index < shard_count; index++) {
+            has_head[index] = writer_shards[index]->ring.try_pop(heads[index]);
+        }
+
+        std::size_t count = 0;
+        for (;;) {
+            std::size_t oldest = shard_count;
+            for (std::size_t index = 0; index < shard_count; index++) {
+                if (has_head[index] &&
+                    (oldest == shard_count ||
+                     heads[index].timestamp < heads[oldest].timestamp)) {
+                    oldest = index;
+                }
+            }
+            if (oldest == shard_count) {
+                break;
+            }
+            std::swap(batch[count++], heads[oldest]);
+            has_head[oldest] = count < max_batch_size &&
+                               writer_shards[oldest]->ring.try_pop(heads[oldest]);
+        }
+
+        if (count > 0) {
+            write(std::span<AsyncRecord>(batch.data(), count));
+        }
+        batch_epoch.fetch_add(1);
+        return count > 0;
+    }
+
+    /**
+     * @brief Puts the writer thread to sleep until a producer wakes it up or
+     * the timeout expires.
+     *
+     * @param timeout
+     */
+    void wait_for_messages(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        is_writer_sleeping.store(true);
+        bool is_empty = shards_generation.load() == writer_shards_generation;
+        for (const std::shared_ptr<Shard>& shard : writer_shards) {
+            if (shard->ring.popped_count() != shard->ring.pushed_count()) {
+                is_empty = false;
+            }
+        }
+        if (is_empty) {
+            wake_condition.wait_for(lock, timeout);
+        }
+        is_writer_sleeping.store(false);
+    }
+
+    /**
+     * @brief Wakes the writer thread up.
+     *
+     */
+    void wake() {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        wake_condition.notify_one();
+    }
+
+    /**
+     * @brief Blocks until every message queued before the call has been
+     * written or dropped, or until the deadline.
+     *
+     * @param deadline
+     * @return true if the queue was drained
+     * @return false if the deadline passed first
+     */
+    bool wait_until_drained(std::chrono::steady_clock::time_point deadline =
+                                std::chrono::steady_clock::time_point::max()) {
+        std::vector<std::pair<std::shared_ptr<Shard>, std::size_t>> targets;
+        {
+            std::lock_guard<std::mutex> lock(shards_mutex);
+            for (const std::shared_ptr<Shard>& shard : shards) {
+                targets.emplace_back(shard, shard->ring.pushed_count());
+            }
+        }
+        for (const auto& [shard, target] : targets) {
+            while (shard->ring.popped_count() < target) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    return false;
+                }
+                wake();
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+        const std::uint64_t epoch = batch_epoch.load();
+        if (epoch & 1) {
+            while (batch_epoch.load() == epoch) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Number of messages discarded by the overflow policy.
+     *
+     * @return std::uint64_t
+     */
+    std::uint64_t get_dropped_count() {
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        std::uint64_t count = removed_dropped_count;
+        for (const std::shared_ptr<Shard>& shard : shards) {
+            count += shard->dropped_count.load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+};
+
+#ifdef HERRLOG_HAS_IO_URING
+/**
+ * @brief Minimal io_uring through the raw system calls, only what the
+ * UringFileSink needs: queueing writes and reaping their completions.
+ *
+ */
+class IoUring {
+   private:
+    int ring_fd = -1;
+    void* submission_ring = MAP_FAILED;
+    std::size_t submission_ring_size = 0;
+    void* completion_ring = MAP_FAILED;
+    std::size_t completion_ring_size = 0;
+    io_uring_sqe* entries = static_cast<io_uring_sqe*>(MAP_FAILED);
+    std::size_t entries_size = 0;
+
+    unsigned* submission_head = nullptr;
+    unsigned* submission_tail = nullptr;
+    unsigned* submission_mask = nullptr;
+    unsigned* submission_array = nullptr;
+    unsigned* completion_head = nullptr;
+    unsigned* completion_tail = nullptr;
+    unsigned* completion_mask = nullptr;
+    io_uring_cqe* completions = nullptr;
+
+    static unsigned* ring_field(void* ring, std::uint32_t offset) {
+        return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+    }
+
+    void release() {
+        if (entries != MAP_FAILED) {
+            munmap(entries, entries_size);
+        }
+        if (completion_ring != MAP_FAILED &&
+            completion_ring != submission_ring) {
+            munmap(completion_ring, completion_ring_size);
+        }
+        if (submission_ring != MAP_FAILED) {
+            munmap(submission_ring, submission_ring_size);
+        }
+        if (ring_fd != -1) {
+            close(ring_fd);
+        }
+        ring_fd = -1;
+    }
+
+    int enter(unsigned submit_count, unsigned wait_count, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, ring_fd,
+                                        submit_count, wait_count, flags,
+                                        nullptr, 0));
+    }
+
+   public:
+    /**
+     * @brief Sets up a ring, check is_available as the kernel may not
+     * support or allow io_uring.
+     *
+     * @param entry_count
+     */
+    explicit IoUring(unsigned entry_count) {
+        io_uring_params params{};
+        ring_fd = static_cast<int>(
+            syscall(__NR_io_uring_setup, entry_count, &params));
+        if (ring_fd < 0) {
+            ring_fd = -1;
+            return;
+        }
+
+        submission_ring_size =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        completion_ring_size =
+            params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            submission_ring_size =
+                std::max(submission_ring_size, completion_ring_size);
+        }
+        submission_ring =
+            mmap(nullptr, submission_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (submission_ring == MAP_FAILED) {
+            release();
+            return;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            completion_ring = submission_ring;
+        } else {
+            completion_ring =
+                mmap(nullptr, completion_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        }
+        entries_size = params.sq_entries * sizeof(io_uring_sqe);
+        entries = static_cast<io_uring_sqe*>(
+            mmap(nullptr, entries_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (completion_ring == MAP_FAILED || entries == MAP_FAILED) {
+            release();
+            return;
+        }
+
+        submission_head = ring_field(submission_ring, params.sq_off.head);
+        submission_tail = ring_field(submission_ring, params.sq_off.tail);
+        submission_mask = ring_field(submission_ring, params.sq_off.ring_mask);
+        submission_array = ring_field(submission_ring, params.sq_off.array);
+        completion_head = ring_field(completion_ring, params.cq_off.head);
+        completion_tail = ring_field(completion_ring, params.cq_off.tail);
+        completion_mask = ring_field(completion_ring, params.cq_off.ring_mask);
+        completions = reinterpret_cast<io_uring_cqe*>(
+            static_cast<char*>(completion_ring) + params.cq_off.cqes);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() { release(); }
+
+    bool is_available() const { return ring_fd != -1; }
+
+    /**
+     * @brief Queues and submits a write. The caller keeps at most as many
+     * writes in flight as the ring has entries.
+     *
+     * @param fd
+     * @param data
+     * @param size
+     * @param offset
+     * @param user_data handed back with the completion
+     * @return true if the write was submitted, its completion will come
+     * @return false otherwise, the entry is taken back so a later submission
+     * does not write the data, which the caller may reuse
+     */
+    bool submit_write(int fd, const char* data, std::uint32_t size,
+                      std::uint64_t offset, std::uint64_t user_data) {
+        const unsigned tail = *submission_tail;
+        const unsigned index = tail & *submission_mask;
+        io_uring_sqe& entry = entries[index];
+        std::memset(&entry, 0, sizeof(entry));
+        entry.opcode = IORING_OP_WRITE;
+        entry.fd = fd;
+        entry.addr = reinterpret_cast<std::uint64_t>(data);
+        entry.len = size;
+        entry.off = offset;
+        entry.user_data = user_data;
+        submission_array[index] = index;
+        std::atomic_ref<unsigned>(*submission_tail)
+            .store(tail + 1, std::memory_order_release);
+        int submitted_count;
+        do {
+            submitted_count = enter(1, 0, 0);
+        } while (submitted_count < 0 && errno == EINTR);
+        if (submitted_count == 1) {
+            return true;
+        }
+        // Without SQPOLL the kernel only consumes entries in io_uring_enter,
+        // so an entry it did not consume can still be taken back
+        if (std::atomic_ref<unsigned>(*submission_head)
+                .load(std::memory_order_acquire) == tail) {
+            std::atomic_ref<unsigned>(*submission_tail)
+                .store(tail, std::memory_order_release);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * @brief Reaps completions, waiting until at least wait_count are there.
+     *
+     * @param wait_count
+     * @param on_completion called with the user data and result of each
+     */
+    template <typename Function>
+    void reap(unsigned wait_count, const Function& on_completion) {
+        unsigned head = *completion_head;
+        unsigned tail = std::atomic_ref<unsigned>(*completion_tail)
+                            .load(std::memory_order_acquire);
+        if (tail - head < wait_count) {
+            enter(0, wait_count, IORING_ENTER_GETEVENTS);
+            tail = std::atomic_ref<unsigned>(*completion_tail)
+                       .load(std::memory_order_acquire);
+        }
+        for (; head != tail; head++) {
+            const io_uring_cqe& completion =
+                completions[head & *completion_mask];
+            on_completion(completion.user_data, completion.res);
+        }
+        std::atomic_ref<unsigned>(*completion_head)
+            .store(head, std::memory_order_release);
+    }
+};
+#endif
+
+/**
+ * @brief A file written through a buffer of its own. On Unix systems it is a
+ * file descriptor written with write(2), so a crash signal handler can still
+ * write what is buffered, see write_from_signal. Elsewhere it is a
+ * std::ofstream.
+ *
+ */
+class FileWriter {
+   private:
+    // Written once full, or on flush
+    static constexpr std::size_t buffer_size = 64 * 1024;
+
+#if defined(__unix__)
+    int file_descriptor = -1;
+    std::unique_ptr<char[]> buffer;
+    std::size_t buffered_size = 0;
+
+    /**
+     * @brief Writes all the bytes, continuing after short writes. Only calls
+     * write(2), so it is async-signal-safe.
+     *
+     * @param data
+     * @param size
+     */
+    void write_all(const char* data, std::size_t size) noexcept {
+        while (size != 0) {
+            const ssize_t written = ::write(file_descriptor, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            data += written;
+            size -= static_cast<std::size_t>(written);
+        }
+    }
+#else
+    std::ofstream file;
+#endif
+
+   public:
+#if defined(__unix__)
+    static constexpr bool is_writable_from_signal = true;
+#else
+    static constexpr bool is_writable_from_signal = false;
+#endif
+
+    /**
+     * @brief Construct a new File Writer object, truncating the file unless
+     * mode has std::ios::app.
+     *
+     * @param file_name
+     * @param mode
+     */
+    explicit FileWriter(const std::string& file_name,
+                        std::ios::openmode mode = std::ios::out)
+#if defined(__unix__)
+        : file_descriptor(open(file_name.c_str(),
+                               O_WRONLY | O_CREAT | O_CLOEXEC |
+                                   ((mode & std::ios::app) ? O_APPEND
+                                                           : O_TRUNC),
+                               0644)),
+          buffer(std::make_unique<char[]>(buffer_size)) {
+    }
+#else
+        : file(file_name, mode) {
+    }
+#endif
+
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    ~FileWriter() {
+#if defined(__unix__)
+        if (file_descriptor != -1) {
+            flush();
+            close(file_descriptor);
+        }
+#endif
+    }
+
+    /**
+     * @brief Whether the file could be opened.
+     *
+     * @return true if it is open
+     * @return false otherwise
+     */
+    bool is_open() const {
+#if defined(__unix__)
+        return file_descriptor != -1;
+#else
+        return file.is_open();
+#endif
+    }
+
+    void write(std::string_view text) {
+#if defined(__unix__)
+        if (file_descriptor == -1) {
+            return;
+        }
+        if (buffered_size + text.size() > buffer_size) {
+            flush();
+        }
+        if (text.size() >= buffer_size) {
+            write_all(text.data(), text.size());
+            return;
+        }
+        std::memcpy(buffer.get() + buffered_size, text.data(), text.size());
+        buffered_size += text.size();
+#else
+        file.write(text.data(), static_cast<std::streamsize>(text.size()));
+#endif
+    }
+
+    void flush() {
+#if defined(__unix__)
+        write_all(buffer.get(), buffered_size);
+        buffered_size = 0;
+#else
+        file.flush();
+#endif
+    }
+
+    /**
+     * @brief Writes what is buffered from a signal handler, while no thread
+     * writes to the file. Does nothing unless is_writable_from_signal.
+     *
+     */
+    void write_from_signal() noexcept {
+#if defined(__unix__)
+        if (file_descriptor != -1) {
+            write_all(buffer.get(), buffered_size);
+            buffered_size = 0;
+        }
+#endif
+    }
+};
+
+}  // namespace herrlog_detail
+
+/**
+ * @brief A formatted message as handed to sinks. It is formatted once and
+ * shared by every sink it goes to.
+ *
+ */
+struct LogRecord {
+    LogType type = LogType::None;
+    // "[NAME time] message\n", without colors
+    std::string_view text;
+    // Size of the "[NAME time]" prefix, the part colored on color outputs.
+    // 0 for messages without a prefix, e.g. JSON, which stay uncolored
+    std::size_t prefix_size = 0;
+    std::string_view color;
+};
+
+/**
+ * @brief Destination of log messages. Each sink has its own log types and
+ * color setting, the Logger serializes calls to write and flush.
+ *
+ */
+class Sink {
+   private:
+    std::atomic<LogType> log_type{LogType::All};
+    std::atomic<bool> is_color_output;
+
+   protected:
+    /**
+     * @brief Writes a record to a stream, colored or not.
+     *
+     * @param stream
+     * @param record
+     * @param is_color_output
+     */
+    static void write_to_stream(std::ostream& stream, const LogRecord& record,
+                                bool is_color_output) {
+        if (is_color_output && record.prefix_size != 0) {
+            stream.write(record.color.data(),
+                         static_cast<std::streamsize>(record.color.size()));
+            stream.write(record.text.data(),
+                         static_cast<std::streamsize>(record.prefix_size));
+            stream.write(ascii_colors::reset_color.data(),
+                         static_cast<std::streamsize>(
+                             ascii_colors::reset_color.size()));
+            stream.write(record.text.data() + record.prefix_size,
+                         static_cast<std::streamsize>(record.text.size() -
+                                                      record.prefix_size));
+        } else {
+            stream.write(record.text.data(),
+                         static_cast<std::streamsize>(record.text.size()));
+        }
+    }
+
+    /**
+     * @brief Writes a record to a file, colored or not.
+     *
+     * @param file
+     * @param record
+     * @param is_color_output
+     */
+    static void write_to_file(herrlog_detail::FileWriter& file,
+                              const LogRecord& record, bool is_color_output) {
+        if (is_color_output && record.prefix_size != 0) {
+            file.write(record.color);
+            file.write(record.text.substr(0, record.prefix_size));
+            file.write(ascii_colors::reset_color);
+            file.write(record.text.substr(record.prefix_size));
+        } else {
+            file.write(record.text);
+        }
+    }
+
+   public:
+    explicit Sink(bool is_color_output = false)
+        : is_color_output(is_color_output) {}
+
+    virtual ~Sink() = default;
+
+    /**
+     * @brief Writes a record, only called for records of the sink's types.
+     *
+     * @param record
+     */
+    virtual void write(const LogRecord& record) = 0;
+
+    /**
+     * @brief Writes records logged together, of any type. By default those
+     * of the sink's types are written one by one, sinks that can write many
+     * at once override it.
+     *
+     * @param records
+     */
+    virtual void write_batch(std::span<const LogRecord> records) {
+        const LogType log_type = get_type();
+        for (const LogRecord& record : records) {
+            if (log_type & record.type) {
+                write(record);
+            }
+        }
+    }
+
+    /**
+     * @brief Flushes what the sink buffered, called as the flush policy says.
+     *
+     */
+    virtual void flush() {}
+
+    /**
+     * @brief Flushes on an explicit Logger::flush, where a sink may also wait
+     * until the data is on the disk. By default the same as flush.
+     *
+     */
+    virtual void sync() { flush(); }
+
+    /**
+     * @brief Writes what the sink buffered from a crash signal handler, so
+     * with write(2) and the like only: no locks, allocations or streams.
+     * Sinks that cannot, e.g. those writing to a std::ostream, do nothing.
+     *
+     */
+    virtual void flush_from_signal() noexcept {}
+
+    /**
+     * @brief Whether a crash loses nothing the sink was given once
+     * flush_from_signal ran, as the sink writes what it buffered then or
+     * buffers nothing. Only such sinks wait for the flush policy when
+     * logging synchronously, the others are flushed after every write.
+     * By default false.
+     *
+     * @return true if it is durable
+     * @return false otherwise
+     */
+    virtual bool is_flushable_from_signal() const { return false; }
+
+    /**
+     * @brief Whether the sink may still be written and flushed at exit,
+     * during static destruction. Only sinks writing to what they own or to
+     * what lives until then, e.g. a file, a file descriptor or memory, may.
+     * By default false, as a sink may write to objects of the program that
+     * are already destroyed.
+     *
+     * @return true if it is safe
+     * @return false otherwise
+     */
+    virtual bool is_safe_at_exit() const { return false; }
+
+    /**
+     * @brief Sets the log types written to this sink, default is LogType::All.
+     *
+     * @param log_type
+     */
+    void set_type(LogType log_type) { this->log_type.store(log_type); }
+
+    LogType get_type() const { return log_type.load(); }
+
+    /**
+     * @brief Set the is color output object
+     *
+     * @param is_color_output
+     */
+    void set_is_color_output(bool is_color_output) {
+        this->is_color_output.store(is_color_output);
+    }
+
+    bool get_is_color_output() const { return is_color_output.load(); }
+};
+
+/**
+ * @brief Writes messages to a std::ostream, e.g. std::cout, or to a file it
+ * owns, see set_file.
+ *
+ */
+class StreamSink : public Sink {
+   private:
+    std::ostream* stream;
+    // Whether the stream lives until the program ends, see set_stream
+    bool is_lasting_stream = false;
+    // Written instead of the stream when set
+    std::unique_ptr<herrlog_detail::FileWriter> file;
+
+    static bool is_standard_stream(const std::ostream& stream) {
+        return &stream == &std::cout || &stream == &std::cerr ||
+               &stream == &std::clog;
+    }
+
+   public:
+    explicit StreamSink(std::ostream& stream, bool is_color_output = false)
+        : Sink(is_color_output),
+          stream(&stream),
+          is_lasting_stream(is_standard_stream(stream)) {}
+
+    /**
+     * @brief Set the stream object, the previous stream is flushed.
+     *
+     * @param stream
+     * @param is_lasting whether the stream outlives the logger, e.g. a
+     * static, so the sink is still written at exit. The standard streams
+     * always are.
+     */
+    void set_stream(std::ostream& stream, bool is_lasting = false) {
+        flush();
+        file.reset();
+        this->stream = &stream;
+        is_lasting_stream = is_lasting || is_standard_stream(stream);
+    }
+
+    /**
+     * @brief Writes to a file instead of the stream until set_stream is
+     * called. Unlike a stream, a crash signal handler can flush it. The
+     * previous file or stream is flushed.
+     *
+     * @param file
+     */
+    void set_file(std::unique_ptr<herrlog_detail::FileWriter> file) {
+        flush();
+        this->file = std::move(file);
+    }
+
+    void write(const LogRecord& record) override {
+        if (file) {
+            write_to_file(*file, record, get_is_color_output());
+        } else {
+            write_to_stream(*stream, record, get_is_color_output());
+        }
+    }
+
+    void flush() override {
+        if (file) {
+            file->flush();
+        } else {
+            stream->flush();
+        }
+    }
+
+    void flush_from_signal() noexcept override {
+        if (file) {
+            file->write_from_signal();
+        }
+    }
+
+    bool is_flushable_from_signal() const override {
+        return file && herrlog_detail::FileWriter::is_writable_from_signal;
+    }
+
+    bool is_safe_at_exit() const override { return file || is_lasting_stream; }
+};
+
+/**
+ * @brief Writes messages to a file, truncated when the sink is created.
+ *
+ */
+class FileSink : public Sink {
+   private:
+    herrlog_detail::FileWriter file;
+
+   public:
+    explicit FileSink(const std::string& file_name) : file(file_name) {}
+
+    /**
+     * @brief Whether the file could be opened.
+     *
+     * @return true if it is open
+     * @return false otherwise
+     */
+    bool is_open() const { return file.is_open(); }
+
+    void write(const LogRecord& record) override {
+        write_to_file(file, record, get_is_color_output());
+    }
+
+    void flush() override { file.flush(); }
+
+    void flush_from_signal() noexcept override { file.write_from_signal(); }
+
+    bool is_flushable_from_signal() const override {
+        return herrlog_detail::FileWriter::is_writable_from_signal;
+    }
+
+    bool is_safe_at_exit() const override { return true; }
+};
+
+/**
+ * @brief Keeps the last messages in memory, e.g. to attach them to a crash
+ * report or to inspect them in tests.
+ *
+ */
+class RingSink : public Sink {
+   private:
+    mutable std::mutex lines_mutex;
+    std::vector<std::string> lines;
+    std::size_t next_line = 0;
+    std::size_t line_count = 0;
+
+   public:
+    /**
+     * @brief Construct a new Ring Sink object
+     *
+     * @param capacity number of messages kept
+     */
+    explicit RingSink(std::size_t capacity)
+        : lines(std::max<std::size_t>(capacity, 1)) {}
+
+    void write(const LogRecord& record) override {
+        std::lock_guard<std::mutex> lock(lines_mutex);
+        std::string& line = lines[next_line];
+        // Without the newline
+        const std::string_view text =
+            record.text.substr(0, record.text.size() - 1);
+        if (get_is_color_output() && record.prefix_size != 0) {
+            line.assign(record.color);
+            line.append(text.substr(0, record.prefix_size));
+            line.append(ascii_colors::reset_color);
+            line.append(text.substr(record.prefix_size));
+        } else {
+            line.assign(text);
+        }
+        next_line = (next_line + 1) % lines.size();
+        line_count = std::min(line_count + 1, lines.size());
+    }
+
+    bool is_safe_at_exit() const override { return true; }
+
+    /**
+     * @brief Get the kept messages, oldest first.
+     *
+     * @return std::vector<std::string>
+     */
+    std::vector<std::string> get_lines() const {
+        std::lock_guard<std::mutex> lock(lines_mutex);
+        std::vector<std::string> ordered_lines;
+        ordered_lines.reserve(line_count);
+        for (std::size_t index = 0; index < line_count; index++) {
+            ordered_lines.push_back(
+                lines[(next_line + lines.size() - line_count + index) %
+                      lines.size()]);
+        }
+        return ordered_lines;
+    }
+};
+
+#if defined(__unix__)
+/**
+ * @brief Writes messages straight to a file descriptor, skipping the
+ * std::ostream layer. Messages logged together, in a Logger::Batch or by the
+ * asynchronous writer, are written with a single writev.
+ *
+ */
+class FdSink : public Sink {
+   private:
+    // Linux IOV_MAX
+    static constexpr std::size_t max_vectors = 1024;
+
+    int file_descriptor = -1;
+    bool is_owned = false;
+    std::vector<iovec> vectors;
+
+    /**
+     * @brief Adds text to the pending vectors, merged with the previous one
+     * when adjacent in memory, as consecutive records usually are.
+     *
+     * @param text
+     */
+    void add_vector(std::string_view text) {
+        if (text.empty()) {
+            return;
+        }
+        if (!vectors.empty() &&
+            static_cast<const char*>(vectors.back().iov_base) +
+                    vectors.back().iov_len ==
+                text.data()) {
+            vectors.back().iov_len += text.size();
+            return;
+        }
+        vectors.push_back({const_cast<char*>(text.data()), text.size()});
+    }
+
+    /**
+     * @brief Writes the pending vectors, continuing after short writes.
+     *
+     */
+    void write_vectors() {
+        iovec* vector = vectors.data();
+        iovec* const vectors_end = vector + vectors.size();
+        while (vector != vectors_end) {
+            const int count = static_cast<int>(std::min<std::size_t>(
+                static_cast<std::size_t>(vectors_end - vector), max_vectors));
+            const ssize_t written = writev(file_descriptor, vector, count);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            std::size_t written_size = static_cast<std::size_t>(written);
+            while (vector != vectors_end && written_size >= vector->iov_len) {
+                written_size -= vector->iov_len;
+                vector++;
+            }
+            if (written_size != 0) {
+                vector->iov_base =
+                    static_cast<char*>(vector->iov_base) + written_size;
+                vector->iov_len -= written_size;
+            }
+        }
+        vectors.clear();
+    }
+
+   public:
+    /**
+     * @brief Construct a new Fd Sink object writing to a file descriptor the
+     * caller keeps open, e.g. STDERR_FILENO.
+     *
+     * @param file_descriptor
+     * @param is_color_output
+     */
+    explicit FdSink(int file_descriptor, bool is_color_output = false)
+        : Sink(is_color_output), file_descriptor(file_descriptor) {}
+
+    /**
+     * @brief Construct a new Fd Sink object writing to a file it owns,
+     * truncated when the sink is created.
+     *
+     * @param file_name
+     */
+    explicit FdSink(const std::string& file_name)
+        : file_descriptor(open(file_name.c_str(),
+                               O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                               0644)),
+          is_owned(true) {}
+
+    FdSink(const FdSink&) = delete;
+    FdSink& operator=(const FdSink&) = delete;
+
+    ~FdSink() override {
+        if (is_owned && file_descriptor != -1) {
+            close(file_descriptor);
+        }
+    }
+
+    /**
+     * @brief Whether the file could be opened.
+     *
+     * @return true if it is open
+     * @return false otherwise
+     */
+    bool is_open() const { return file_descriptor != -1; }
+
+    void write(const LogRecord& record) override {
+        write_batch(std::span<const LogRecord>(&record, 1));
+    }
+
+    void write_batch(std::span<const LogRecord> records) override {
+        const LogType log_type = get_type();
+        const bool is_color_output = get_is_color_output();
+        for (const LogRecord& record : records) {
+            if (!(log_type & record.type)) {
+                continue;
+            }
+            if (is_color_output && record.prefix_size != 0) {
+                add_vector(record.color);
+                add_vector(record.text.substr(0, record.prefix_size));
+                add_vector(ascii_colors::reset_color);
+                add_vector(record.text.substr(record.prefix_size));
+            } else {
+                add_vector(record.text);
+            }
+        }
+        if (!vectors.empty() && file_descriptor != -1) {
+            write_vectors();
+        }
+        vectors.clear();
+    }
+
+    bool is_flushable_from_signal() const override { return true; }
+
+    bool is_safe_at_exit() const override { return true; }
+};
+#endif
+
+/**
+ * @brief Writes messages to a file that is rotated by size and/or schedule.
+ * Opening the next file, renaming and compressing happen on a background
+ * thread, rotating on the logging side only swaps two file pointers. If the
+ * next file is not ready yet, messages go to the current one until it is.
+ *
+ */
+class RotatingFileSink : public Sink {
+   private:
+    const std::string file_name;
+    // Hidden, so it is not taken for a log file, see get_next_file_name
+    const std::string next_file_name;
+    const RotationPolicy policy;
+    std::unique_ptr<herrlog_detail::FileWriter> file;
+    std::size_t file_size = 0;
+    std::chrono::system_clock::time_point next_rotation_time;
+
+    std::mutex rotation_mutex;
+    std::condition_variable rotation_condition;
+    // Opened in the background, becomes the file on rotation
+    std::unique_ptr<herrlog_detail::FileWriter> next_file;
+    // Replaced by next_file, waiting to be closed and renamed
+    std::unique_ptr<herrlog_detail::FileWriter> rotated_file;
+    bool is_stopping = false;
+    std::thread rotation_thread;
+
+    /**
+     * @brief Name of the n-th rotated file, 1 is the newest.
+     *
+     * @param generation
+     * @return std::string
+     */
+    std::string generation_name(std::size_t generation) const {
+        std::string name = file_name + '.' + std::to_string(generation);
+#ifdef HERRLOG_WITH_ZLIB
+        if (policy.is_compressed) {
+            name += ".gz";
+        }
+#endif
+        return name;
+    }
+
+    /**
+     * @brief Temporary name of the next file, e.g. "logs/.app.log.next" for
+     * "logs/app.log". It is in the same directory so the rotation is a
+     * rename, and hidden so users and log shippers globbing "app.log*" do
+     * not see it.
+     *
+     * @param file_name
+     * @return std::string
+     */
+    static std::string get_next_file_name(const std::string& file_name) {
+        const std::filesystem::path path(file_name);
+        return (path.parent_path() /
+                ("." + path.filename().string() + ".next"))
+            .string();
+    }
+
+    /**
+     * @brief Start of the next hour or day in local time.
+     *
+     * @return std::chrono::system_clock::time_point
+     */
+    std::chrono::system_clock::time_point get_next_rotation_time() const {
+        if (policy.schedule == RotationSchedule::None) {
+            return std::chrono::system_clock::time_point::max();
+        }
+        const std::time_t now = std::chrono::system_clock::to_time_t(
+            std::chrono::system_clock::now());
+        std::tm local_time{};
+#if defined(_WIN32)
+        localtime_s(&local_time, &now);
+#else
+        localtime_r(&now, &local_time);
+#endif
+        local_time.tm_sec = 0;
+        local_time.tm_min = 0;
+        local_time.tm_hour++;
+        if (policy.schedule == RotationSchedule::Daily) {
+            local_time.tm_hour = 0;
+            local_time.tm_mday++;
+        }
+        // Let mktime work out daylight saving time
+        local_time.tm_isdst = -1;
+        return std::chrono::system_clock::from_time_t(std::mktime(&local_time));
+    }
+
+#ifdef HERRLOG_WITH_ZLIB
+    /**
+     * @brief Gzips a file and removes it once the archive is complete.
+     *
+     * @param source
+     * @param destination
+     */
+    static void compress_file(const std::string& source,
+                              const std::string& destination) {
+        std::ifstream input(source, std::ios::binary);
+        gzFile output = gzopen(destination.c_str(), "wb");
+        if (!input.is_open() || output == nullptr) {
+            if (output != nullptr) {
+                gzclose(output);
+            }
+            return;
+        }
+        std::array<char, 64 * 1024> chunk;
+        bool is_written = true;
+        while (input.read(chunk.data(), chunk.size()) || input.gcount() > 0) {
+            const int size = static_cast<int>(input.gcount());
+            if (gzwrite(output, chunk.data(), static_cast<unsigned>(size)) !=
+                size) {
+                is_written = false;
+                break;
+            }
+        }
+        input.close();
+        if (gzclose(output) == Z_OK && is_written) {
+            std::error_code error;
+            std::filesystem::remove(source, error);
+        }
+    }
+#endif
+
+    /**
+     * @brief Closes a replaced file, shifts the generations and puts the new
+     * file in place. Compressing the rotated file is left to run_rotation.
+     *
+     * @param old_file
+     */
+    void finish_rotation(std::unique_ptr<herrlog_detail::FileWriter> old_file) {
+        old_file.reset();
+
+        // Missing generations are expected, errors are ignored
+        std::error_code error;
+        if (policy.max_files == 0) {
+            std::filesystem::remove(file_name, error);
+            std::filesystem::rename(next_file_name, file_name, error);
+            return;
+        }
+        std::filesystem::remove(generation_name(policy.max_files), error);
+        for (std::size_t generation = policy.max_files; generation-- > 1;) {
+            std::filesystem::rename(generation_name(generation),
+                                    generation_name(generation + 1), error);
+        }
+        std::filesystem::rename(file_name, file_name + ".1", error);
+        std::filesystem::rename(next_file_name, file_name, error);
+    }
+
+    /**
+     * @brief Background thread, keeps the next file open and finishes
+     * rotations. A rotated file is compressed only once the next file is
+     * open, so a rotation due meanwhile is not held up by the compression.
+     *
+     */
+    void run_rotation() {
+        // Whether file_name.1 is still to be gzipped
+        bool is_compression_pending = false;
+        std::unique_lock<std::mutex> lock(rotation_mutex);
+        for (;;) {
+            rotation_condition.wait(lock, [&] {
+                return rotated_file || !next_file || is_stopping ||
+                       is_compression_pending;
+            });
+            if (rotated_file) {
+                std::unique_ptr<herrlog_detail::FileWriter> old_file =
+                    std::move(rotated_file);
+                lock.unlock();
+                finish_rotation(std::move(old_file));
+                lock.lock();
+#ifdef HERRLOG_WITH_ZLIB
+                is_compression_pending =
+                    policy.is_compressed && policy.max_files != 0;
+#endif
+                continue;
+            }
+
+            if (!next_file && !is_stopping) {
+                lock.unlock();
+                auto opened_file =
+                    std::make_unique<herrlog_detail::FileWriter>(
+                        next_file_name);
+                lock.lock();
+                if (opened_file->is_open()) {
+                    next_file = std::move(opened_file);
+                    continue;
+                }
+                if (!is_compression_pending) {
+                    // Retry later, until then the current file keeps growing
+                    rotation_condition.wait_for(
+                        lock, std::chrono::seconds(1),
+                        [this] { return is_stopping; });
+                    continue;
+                }
+            }
+
+#ifdef HERRLOG_WITH_ZLIB
+            if (is_compression_pending) {
+                lock.unlock();
+                compress_file(file_name + ".1", generation_name(1));
+                lock.lock();
+                is_compression_pending = false;
+                continue;
+            }
+#endif
+            if (is_stopping) {
+                return;
+            }
+        }
+    }
+
+    /**
+     * @brief Swaps in the next file if it is ready. The current file is
+     * flushed first, as flush_from_signal only reaches the file in use.
+     *
+     */
+    void rotate() {
+        std::unique_lock<std::mutex> lock(rotation_mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !next_file) {
+            return;
+        }
+        file->flush();
+        rotated_file = std::move(file);
+        file = std::move(next_file);
+        file_size = 0;
+        next_rotation_time = get_next_rotation_time();
+        lock.unlock();
+        rotation_condition.notify_one();
+    }
+
+   public:
+    /**
+     * @brief Construct a new Rotating File Sink object, appending to the file
+     * if it already exists.
+     *
+     * @param file_name
+     * @param policy
+     */
+    RotatingFileSink(const std::string& file_name, const RotationPolicy& policy)
+        : file_name(file_name),
+          next_file_name(get_next_file_name(file_name)),
+          policy(policy),
+          file(std::make_unique<herrlog_detail::FileWriter>(file_name,
+                                                            std::ios::app)),
+          next_rotation_time(get_next_rotation_time()) {
+        std::error_code error;
+        const std::uintmax_t size =
+            std::filesystem::file_size(file_name, error);
+        file_size = error ? 0 : static_cast<std::size_t>(size);
+        rotation_thread = std::thread(&RotatingFileSink::run_rotation, this);
+    }
+
+    RotatingFileSink(const RotatingFileSink&) = delete;
+    RotatingFileSink& operator=(const RotatingFileSink&) = delete;
+
+    ~RotatingFileSink() override {
+        {
+            std::lock_guard<std::mutex> lock(rotation_mutex);
+            is_stopping = true;
+        }
+        rotation_condition.notify_one();
+        rotation_thread.join();
+        if (next_file) {
+            next_file.reset();
+            std::error_code error;
+            std::filesystem::remove(next_file_name, error);
+        }
+    }
+
+    /**
+     * @brief Whether the file could be opened.
+     *
+     * @return true if it is open
+     * @return false otherwise
+     */
+    bool is_open() const { return file->is_open(); }
+
+    void write(const LogRecord& record) override {
+        if ((policy.max_bytes != 0 && file_size != 0 &&
+             file_size + record.text.size() > policy.max_bytes) ||
+            (policy.schedule != RotationSchedule::None &&
+             std::chrono::system_clock::now() >= next_rotation_time)) {
+            rotate();
+        }
+        write_to_file(*file, record, get_is_color_output());
+        file_size += record.text.size();
+    }
+
+    void flush() override { file->flush(); }
+
+    void flush_from_signal() noexcept override { file->write_from_signal(); }
+
+    bool is_flushable_from_signal() const override {
+        return herrlog_detail::FileWriter::is_writable_from_signal;
+    }
+
+    bool is_safe_at_exit() const override { return true; }
+};
+
+#if defined(__unix__)
+/**
+ * @brief Writes messages to a file through a memory mapping. The file grows
+ * by preallocated segments that are mapped one at a time, so a message is a
+ * memcpy without any system call. The kernel owns the written pages, they
+ * reach the file even if the process crashes. Flushing syncs them to the
+ * disk, so this sink is meant to be used with a FlushPolicy.
+ *
+ */
+class MappedFileSink : public Sink {
+   private:
+    int file_descriptor = -1;
+    const std::size_t segment_size;
+    char* segment = nullptr;
+    // File offset of the mapped segment
+    std::size_t segment_offset = 0;
+    // Write position within the segment
+    std::size_t position = 0;
+    // Start of what is not synced yet within the segment
+    std::size_t synced_position = 0;
+    // Start of what is not handed to the kernel for write back yet
+    std::size_t flushed_position = 0;
+    // Whether earlier segments may have unsynced pages
+    bool has_unsynced_segments = false;
+
+    /**
+     * @brief msyncs the segment from a position to the write position.
+     *
+     * @param start
+     * @param flags MS_SYNC or MS_ASYNC
+     */
+    void sync_segment(std::size_t start, int flags) {
+        if (segment == nullptr || position == start) {
+            return;
+        }
+        // msync wants a page aligned start
+        const std::size_t page_size =
+            static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+        const std::size_t page_start = start / page_size * page_size;
+        msync(segment + page_start, position - page_start, flags);
+    }
+
+    /**
+     * @brief Preallocates and maps the segment at the given file offset.
+     *
+     * @param offset
+     * @return true if the segment is mapped
+     * @return false otherwise
+     */
+    bool map_segment(std::size_t offset) {
+        if (posix_fallocate(file_descriptor, static_cast<off_t>(offset),
+                            static_cast<off_t>(segment_size)) != 0) {
+            return false;
+        }
+        void* mapping =
+            mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                 file_descriptor, static_cast<off_t>(offset));
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+        segment = static_cast<char*>(mapping);
+        segment_offset = offset;
+        position = 0;
+        synced_position = 0;
+        flushed_position = 0;
+        return true;
+    }
+
+    /**
+     * @brief Unmaps the segment, the kernel still writes its pages back.
+     *
+     */
+    void unmap_segment() {
+        if (position != synced_position) {
+            has_unsynced_segments = true;
+        }
+        munmap(segment, segment_size);
+        segment = nullptr;
+    }
+
+    /**
+     * @brief Copies text to the mapping, moving to the next segment when the
+     * current one is full.
+     *
+     * @param text
+     */
+    void append(std::string_view text) {
+        while (!text.empty() && segment != nullptr) {
+            const std::size_t size =
+                std::min(text.size(), segment_size - position);
+            std::memcpy(segment + position, text.data(), size);
+            position += size;
+            text.remove_prefix(size);
+            if (position == segment_size) {
+                const std::size_t next_offset = segment_offset + segment_size;
+                unmap_segment();
+                // On failure the rest of the messages is lost
+                map_segment(next_offset);
+            }
+        }
+    }
+
+   public:
+    /**
+     * @brief Construct a new Mapped File Sink object, truncating the file.
+     *
+     * @param file_name
+     * @param segment_size bytes preallocated and mapped at once, rounded up
+     * to whole pages
+     */
+    explicit MappedFileSink(const std::string& file_name,
+                            std::size_t segment_size = 16 * 1024 * 1024)
+        : segment_size([segment_size] {
+              const std::size_t page_size =
+                  static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+              return std::max<std::size_t>(
+                  (segment_size + page_size - 1) / page_size * page_size,
+                  page_size);
+          }()) {
+        file_descriptor =
+            open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644);
+        if (file_descriptor != -1 && !map_segment(0)) {
+            close(file_descriptor);
+            file_descriptor = -1;
+        }
+    }
+
+    MappedFileSink(const MappedFileSink&) = delete;
+    MappedFileSink& operator=(const MappedFileSink&) = delete;
+
+    /**
+     * @brief Destroy the Mapped File Sink object, syncing the file and
+     * cutting the preallocated space that was not written.
+     *
+     */
+    ~MappedFileSink() override {
+        if (file_descriptor == -1) {
+            return;
+        }
+        sync();
+        const std::size_t size = segment_offset + position;
+        if (segment != nullptr) {
+            unmap_segment();
+        }
+        if (ftruncate(file_descriptor, static_cast<off_t>(size)) != 0) {
+            // Nothing to do, the file keeps its zero filled tail
+        }
+        close(file_descriptor);
+    }
+
+    /**
+     * @brief Whether the file could be opened and mapped.
+     *
+     * @return true if it is open
+     * @return false otherwise
+     */
+    bool is_open() const { return segment != nullptr; }
+
+    void write(const LogRecord& record) override {
+        if (get_is_color_output() && record.prefix_size != 0) {
+            append(record.color);
+            append(record.text.substr(0, record.prefix_size));
+            append(ascii_colors::reset_color);
+            append(record.text.substr(record.prefix_size));
+        } else {
+            append(record.text);
+        }
+    }
+
+    /**
+     * @brief Hands the written pages to the kernel for write back without
+     * waiting for the disk, as flush policies flush often. The pages survive
+     * a crash of the process either way.
+     *
+     */
+    void flush() override {
+        sync_segment(flushed_position, MS_ASYNC);
+        flushed_position = position;
+    }
+
+    /**
+     * @brief Syncs the written pages to the disk, on Logger::flush and when
+     * the sink is destroyed.
+     *
+     */
+    void sync() override {
+        if (has_unsynced_segments) {
+            fdatasync(file_descriptor);
+            has_unsynced_segments = false;
+        } else {
+            sync_segment(synced_position, MS_SYNC);
+        }
+        synced_position = position;
+        flushed_position = position;
+    }
+
+    bool is_flushable_from_signal() const override { return true; }
+
+    bool is_safe_at_exit() const override { return true; }
+};
+#endif
+
+#if defined(__unix__)
+/**
+ * @brief Writes messages to a file in large batches. Messages are gathered
+ * in a few buffers of buffer_size bytes, a full buffer is submitted to
+ * io_uring while the next one fills, so several writes can be in flight.
+ * Where io_uring is not available, full buffers are kept until all of them
+ * are full and written with a single writev. A flush writes everything and
+ * waits for it.
+ *
+ */
+class UringFileSink : public Sink {
+   private:
+    int file_descriptor = -1;
+    const std::size_t buffer_size;
+    std::vector<std::string> buffers;
+    // Buffers submitted or waiting for writev, in order from oldest_pending
+    std::vector<bool> is_pending;
+    std::size_t current_buffer = 0;
+    std::size_t oldest_pending = 0;
+    std::size_t pending_count = 0;
+    std::uint64_t file_offset = 0;
+    // Buffers that could not be written in full, see get_failed_write_count
+    std::uint64_t failed_write_count = 0;
+#ifdef HERRLOG_HAS_IO_URING
+    // File offsets of the submitted buffers
+    std::vector<std::uint64_t> buffer_offsets =
+        std::vector<std::uint64_t>(buffers.size());
+    herrlog_detail::IoUring ring{static_cast<unsigned>(buffers.size())};
+#endif
+
+    bool is_uring_available() const {
+#ifdef HERRLOG_HAS_IO_URING
+        return ring.is_available();
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * @brief Blocking write used by the fallback and for short or failed
+     * writes.
+     *
+     * @param data
+     * @param size
+     * @param offset
+     * @return true if everything was written
+     * @return false otherwise, e.g. the disk is full
+     */
+    bool write_at(const char* data, std::size_t size, std::uint64_t offset) {
+        while (size != 0) {
+            const ssize_t written = pwrite(file_descriptor, data, size,
+                                           static_cast<off_t>(offset));
+            if (written <= 0) {
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= static_cast<std::size_t>(written);
+            offset += static_cast<std::uint64_t>(written);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Writes all pending buffers with one pwritev, oldest first.
+     *
+     */
+    void write_pending() {
+        std::array<iovec, 64> vectors;
+        while (pending_count != 0) {
+            const std::size_t count =
+                std::min<std::size_t>(pending_count, vectors.size());
+            for (std::size_t index = 0; index < count; index++) {
+                std::string& buffer =
+                    buffers[(oldest_pending + index) % buffers.size()];
+                vectors[index] = {buffer.data(), buffer.size()};
+            }
+            const ssize_t written =
+                pwritev(file_descriptor, vectors.data(),
+                        static_cast<int>(count),
+                        static_cast<off_t>(file_offset));
+            std::size_t written_size =
+                written > 0 ? static_cast<std::size_t>(written) : 0;
+            for (std::size_t index = 0; index < count; index++) {
+                std::string& buffer = buffers[oldest_pending];
+                // Finish short writes one by one
+                if (written_size < buffer.size() &&
+                    !write_at(buffer.data() + written_size,
+                              buffer.size() - written_size,
+                              file_offset + written_size)) {
+                    failed_write_count++;
+                }
+                written_size -= std::min(written_size, buffer.size());
+                file_offset += buffer.size();
+                buffer.clear();
+                is_pending[oldest_pending] = false;
+                oldest_pending = (oldest_pending + 1) % buffers.size();
+            }
+            pending_count -= count;
+        }
+    }
+
+#ifdef HERRLOG_HAS_IO_URING
+    /**
+     * @brief Frees the buffers of finished writes. Short writes are finished
+     * and failed ones retried with pwrite at the same offset, so a failure
+     * leaves no hole if the retry succeeds.
+     *
+     * @param wait_count
+     */
+    void reap_writes(unsigned wait_count) {
+        ring.reap(wait_count, [this](std::uint64_t index, std::int32_t result) {
+            std::string& buffer = buffers[index];
+            // A negative result is an errno, nothing was written
+            const std::size_t written =
+                result > 0 ? static_cast<std::size_t>(result) : 0;
+            if (written < buffer.size() &&
+                !write_at(buffer.data() + written, buffer.size() - written,
+                          buffer_offsets[index] + written)) {
+                failed_write_count++;
+            }
+            buffer.clear();
+            is_pending[index] = false;
+            pending_count--;
+        });
+    }
+#endif
+
+    /**
+     * @brief Hands the current buffer to the kernel, or keeps it for writev,
+     * and moves to the next free buffer.
+     *
+     */
+    void submit_current() {
+        std::string& buffer = buffers[current_buffer];
+        if (buffer.empty()) {
+            return;
+        }
+        is_pending[current_buffer] = true;
+        pending_count++;
+#ifdef HERRLOG_HAS_IO_URING
+        if (is_uring_available()) {
+            if (ring.submit_write(file_descriptor, buffer.data(),
+                                  static_cast<std::uint32_t>(buffer.size()),
+                                  file_offset, current_buffer)) {
+                buffer_offsets[current_buffer] = file_offset;
+                file_offset += buffer.size();
+            } else {
+                if (!write_at(buffer.data(), buffer.size(), file_offset)) {
+                    failed_write_count++;
+                }
+                file_offset += buffer.size();
+                buffer.clear();
+                is_pending[current_buffer] = false;
+                pending_count--;
+            }
+            current_buffer = (current_buffer + 1) % buffers.size();
+            while (is_pending[current_buffer]) {
+                reap_writes(1);
+            }
+            return;
+        }
+#endif
+        current_buffer = (current_buffer + 1) % buffers.size();
+        if (pending_count == buffers.size()) {
+            write_pending();
+        }
+    }
+
+    void append(std::string_view text) {
+        buffers[current_buffer].append(text);
+    }
+
+   public:
+    /**
+     * @brief Construct a new Uring File Sink object, truncating the file.
+     *
+     * @param file_name
+     * @param buffer_size bytes gathered before a write is submitted
+     * @param buffer_count buffers filled or in flight at once
+     */
+    explicit UringFileSink(const std::string& file_name,
+                           std::size_t buffer_size = 64 * 1024,
+                           std::size_t buffer_count = 4)
+        : buffer_size(buffer_size),
+          buffers(std::max<std::size_t>(buffer_count, 2)),
+          is_pending(buffers.size()) {
+        file_descriptor =
+            open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 0644);
+        for (std::string& buffer : buffers) {
+            buffer.reserve(buffer_size);
+        }
+    }
+
+    UringFileSink(const UringFileSink&) = delete;
+    UringFileSink& operator=(const UringFileSink&) = delete;
+
+    ~UringFileSink() override {
+        if (file_descriptor != -1) {
+            flush();
+            close(file_descriptor);
+        }
+    }
+
+    /**
+     * @brief Whether the file could be opened.
+     *
+     * @return true if it is open
+     * @return false otherwise
+     */
+    bool is_open() const { return file_descriptor != -1; }
+
+    /**
+     * @brief Whether writes go through io_uring rather than writev.
+     *
+     * @return true if io_uring is used
+     * @return false otherwise
+     */
+    bool is_using_io_uring() const { return is_uring_available(); }
+
+    /**
+     * @brief Number of buffers that could not be written in full, even when
+     * retried with pwrite, e.g. as the disk is full. Their place in the file
+     * is left as a hole.
+     *
+     * @return std::uint64_t
+     */
+    std::uint64_t get_failed_write_count() const { return failed_write_count; }
+
+    void write(const LogRecord& record) override {
+        if (file_descriptor == -1) {
+            return;
+        }
+        std::size_t size = record.text.size();
+        if (get_is_color_output() && record.prefix_size != 0) {
+            size += record.color.size() + ascii_colors::reset_color.size();
+        }
+        if (buffers[current_buffer].size() + size > buffer_size) {
+            submit_current();
+        }
+        if (get_is_color_output() && record.prefix_size != 0) {
+            append(record.color);
+            append(record.text.substr(0, record.prefix_size));
+            append(ascii_colors::reset_color);
+            append(record.text.substr(record.prefix_size));
+        } else {
+            append(record.text);
+        }
+    }
+
+    void flush() override {
+        if (file_descriptor == -1) {
+            return;
+        }
+        submit_current();
+#ifdef HERRLOG_HAS_IO_URING
+        if (is_uring_available()) {
+            while (pending_count != 0) {
+                reap_writes(1);
+            }
+            return;
+        }
+#endif
+        write_pending();
+    }
+
+    void flush_from_signal() noexcept override {
+        if (file_descriptor == -1) {
+            return;
+        }
+        std::uint64_t offset = file_offset;
+        if (!is_uring_available()) {
+            // Buffers waiting for writev are not written yet, unlike those
+            // submitted to io_uring
+            for (std::size_t index = 0; index < pending_count; index++) {
+                const std::string& buffer =
+                    buffers[(oldest_pending + index) % buffers.size()];
+                write_at(buffer.data(), buffer.size(), offset);
+                offset += buffer.size();
+            }
+        }
+        const std::string& buffer = buffers[current_buffer];
+        write_at(buffer.data(), buffer.size(), offset);
+    }
+
+    bool is_flushable_from_signal() const override { return true; }
+
+    bool is_safe_at_exit() const override { return true; }
+};
+#endif
+
+/**
+ * @brief A message in the binary log format, as handed to a BinaryFileSink.
+ *
+ */
+struct BinaryMessage {
+    LogType type = LogType::None;
+    // Nanoseconds since the epoch
+    std::uint64_t timestamp = 0;
+    const herrlog_detail::BinaryFormat* format = nullptr;
+    // The format literal pointer, unless logged from a call site, followed
+    // by the binary arguments
+    std::string_view data;
+};
+
+/**
+ * @brief Writes messages to a file in a compact binary format instead of
+ * text, see Logger::set_binary_sink. Messages are not formatted at all, the
+ * herrlog-decode tool turns the file back into text.
+ *
+ * The file starts with "HERRLOG" and a version byte. Then every entry starts
+ * with a byte: 0 for the definition of a format string, otherwise the
+ * LogType of a message.
+ * - A definition is the ID of the format string as a varint, the number of
+ *   arguments and their BinaryType bytes, the number of placeholders, the
+ *   argument and FormatSpec of every placeholder, and the literal segments.
+ *   It is written once per file, before the first message using it.
+ * - A message is the time since the previous message in nanoseconds as a
+ *   zigzag varint, the ID of its format string as a varint, and the
+ *   arguments: numbers as raw bytes, strings as a varint size and the text.
+ * Numbers are in the byte order of the machine that wrote the file.
+ *
+ */
+class BinaryFileSink {
+   private:
+    herrlog_detail::FileWriter file;
+    // The entries of the message being written
+    herrlog_detail::Buffer entries;
+
+    using FormatKey =
+        std::pair<const herrlog_detail::BinaryFormat*, const char*>;
+
+    struct FormatKeyHash {
+        std::size_t operator()(const FormatKey& key) const {
+            return std::hash<const void*>()(key.first) ^
+                   (std::hash<const void*>()(key.second) * 31);
+        }
+    };
+
+    // ID of every format string defined in the file so far. The text is part
+    // of the key as one instantiation of log serves every format string
+    // with the same argument types.
+    std::unordered_map<FormatKey, std::uint64_t, FormatKeyHash> format_ids;
+    // Format string ID plus 1 of call sites, by call site ID, 0 if undefined
+    std::vector<std::uint64_t> call_site_format_ids;
+    std::uint64_t format_count = 0;
+
+    /**
+     * @brief The ID of the format string of a message in this file.
+     *
+     * @param message
+     * @return std::pair<std::uint64_t, bool> the ID and whether it is new
+     */
+    std::pair<std::uint64_t, bool> get_format_id(
+        const BinaryMessage& message) {
+        if (message.format->call_site_id) {
+            const std::uint32_t call_site_id = *message.format->call_site_id;
+            if (call_site_id >= call_site_format_ids.size()) {
+                call_site_format_ids.resize(call_site_id + 1);
+            }
+            std::uint64_t& format_id = call_site_format_ids[call_site_id];
+            const bool is_new = format_id == 0;
+            if (is_new) {
+                format_id = ++format_count;
+            }
+            return {format_id - 1, is_new};
+        }
+        const auto [format_id, is_new] = format_ids.try_emplace(
+            {message.format,
+             message.format->get_literal(message.data.data())},
+            format_count);
+        format_count += is_new;
+        return {format_id->second, is_new};
+    }
+    std::uint64_t previous_timestamp = 0;
+
+   public:
+    explicit BinaryFileSink(const std::string& file_name)
+        : file(file_name, std::ios::out | std::ios::binary) {
+        file.write(std::string_view("HERRLOG\1", 8));
+    }
+
+    BinaryFileSink(const BinaryFileSink&) = delete;
+    BinaryFileSink& operator=(const BinaryFileSink&) = delete;
+
+    ~BinaryFileSink() { flush(); }
+
+    /**
+     * @brief Whether the file could be opened.
+     *
+     * @return true if it is open
+     * @return false otherwise
+     */
+    bool is_open() const { return file.is_open(); }
+
+    /**
+     * @brief Writes a message, preceded by the definition of its format
+     * string the first time it is used.
+     *
+     * @param message
+     */
+    void write(const BinaryMessage& message) {
+        const auto [format_id, is_new] = get_format_id(message);
+        entries.clear();
+        if (is_new) {
+            entries.push_back('\0');
+            herrlog_detail::append_varint(entries, format_id);
+            message.format->describe(entries, message.data.data());
+        }
+
+        entries.push_back(static_cast<char>(message.type.get_bitflag()));
+        herrlog_detail::append_varint(
+            entries, herrlog_detail::zigzag_encode(static_cast<std::int64_t>(
+                         message.timestamp - previous_timestamp)));
+        previous_timestamp = message.timestamp;
+        herrlog_detail::append_varint(entries, format_id);
+        entries.append(message.data.substr(message.format->format_size));
+        file.write(entries.view());
+    }
+
+    void flush() { file.flush(); }
+
+    /**
+     * @brief Writes what is buffered from a crash signal handler, see
+     * Sink::flush_from_signal.
+     *
+     */
+    void flush_from_signal() noexcept { file.write_from_signal(); }
+};
+
+/**
+ * @brief Logger implementation providing flexible logging capabilities.
+ *
+ */
+class Logger {
+   private:
+    static LogType log_type;
+    static std::string output_file_name;
+    static std::shared_ptr<StreamSink> default_sink;
+    static std::vector<std::shared_ptr<Sink>> sinks;
+    static const char* datetime_format;
+    static std::atomic<std::uint64_t> datetime_format_generation;
+    static std::atomic<ClockSource> clock_source;
+    static std::atomic<Encoder> encoder;
+    static std::shared_ptr<BinaryFileSink> binary_sink;
+    static std::atomic<bool> is_binary_output;
+    static herrlog_detail::TscClock tsc_clock;
+    static herrlog_detail::OutputMutex log_mutex;
+    static std::unique_ptr<herrlog_detail::AsyncQueue> async_queue;
+    static std::thread async_writer;
+    static std::atomic<bool> is_async_stopping;
+    // Whether the writer thread runs, read by crash signal handlers
+    static std::atomic<bool> is_async_running;
+    static thread_local bool is_async_writer_thread;
+    static std::atomic<OverflowPolicy> overflow_policy;
+    static std::atomic<bool> is_deferred_formatting;
+    static std::atomic<bool> is_source_location;
+    static std::atomic<bool> is_thread_field;
+    static const char* pattern;
+    static std::atomic<std::uint64_t> pattern_generation;
+
+    static FlushPolicy flush_policy;
+    static std::uint32_t pending_messages;
+    static std::size_t pending_bytes;
+    static std::chrono::steady_clock::time_point first_pending_time;
+    static std::atomic<bool> is_crash_handler_installed;
+    // Set during static destruction, only sinks safe at exit are then used
+    static std::atomic<bool> is_exiting;
+    static std::terminate_handler previous_terminate_handler;
+    // Flushes asked of the writer thread by crash signal handlers, and done
+    static std::atomic<std::uint64_t> signal_flush_requests;
+    static std::atomic<std::uint64_t> signal_flushes;
+
+    using SignalHandler = void (*)(int);
+    static constexpr int crash_signals[] = {
+        SIGSEGV, SIGFPE, SIGILL, SIGABRT,
+#if defined(SIGBUS)
+        SIGBUS,
+#endif
+    };
+    static SignalHandler previous_signal_handlers[std::size(crash_signals)];
+
+    // Size at which a Batch is written even though it did not end yet
+    static constexpr std::size_t max_batch_size = 64 * 1024;
+
+    /**
+     * @brief Stops the asynchronous backend and flushes pending messages
+     * during static destruction (i.e. at exit). Streams of the program may
+     * already be destroyed by then, so only sinks safe at exit are written
+     * and flushed, see Sink::is_safe_at_exit and shutdown.
+     *
+     */
+    struct Shutdown {
+        ~Shutdown() {
+            is_exiting.store(true);
+            Logger::set_async(false);
+            std::lock_guard<herrlog_detail::OutputMutex> lock(
+                Logger::log_mutex);
+            if (pending_messages != 0) {
+                flush_output();
+            }
+        }
+    };
+    static Shutdown shutdown_at_exit;
+
+    /**
+     * @brief Whether a sink may be used now, see is_exiting.
+     *
+     * @param sink
+     * @return true if it may
+     * @return false otherwise
+     */
+    static bool is_usable(const Sink& sink) {
+        return !is_exiting.load(std::memory_order_relaxed) ||
+               sink.is_safe_at_exit();
+    }
+
+    /**
+     * @brief Prints the templated arguments passed, each preceded by its
+     * literal segment of the format string, followed by the last segment.
+     * When placeholders do not simply take the arguments in order, arguments
+     * are looked up by index through type-erased pointers. Fields are left
+     * out, see print_message.
+     *
+     * @tparam Format
+     * @tparam Args
+     * @param buffer
+     * @param format
+     * @param args
+     */
+    template <typename Format, typename... Args>
+    static void print_to_buffer(herrlog_detail::Buffer& buffer,
+                                const Format& format, const Args&... args) {
+        std::size_t index = 0;
+        if (format.is_positional) {
+            const void* const arguments[] = {
+                &herrlog_detail::unwrap_argument(args)..., nullptr};
+            using AppendFunction = void (*)(herrlog_detail::Buffer&,
+                                            const void*, const FormatSpec&);
+            constexpr AppendFunction append_functions[] = {
+                herrlog_detail::get_append_function<
+                    herrlog_detail::unwrapped_t<Args>>()...,
+                nullptr};
+            for (; index < format.placeholder_count; index++) {
+                const std::size_t argument = format.argument_indexes[index];
+                herrlog_detail::append_segment(buffer, format, index);
+                append_functions[argument](buffer, arguments[argument],
+                                           format.specs[index]);
+            }
+        } else if (format.has_specs) {
+            (print_placeholder<true>(buffer, format, index, args), ...);
+        } else {
+            (print_placeholder<false>(buffer, format, index, args), ...);
+        }
+        herrlog_detail::append_segment(buffer, format, index);
+    }
+
+    /**
+     * @brief Prints the next literal segment and the argument of its
+     * placeholder, used when placeholders take the arguments in order.
+     * Fields have no placeholder and print nothing.
+     *
+     * @tparam IsFormatted whether the format string has specifications
+     * @tparam Format
+     * @tparam T
+     * @param buffer
+     * @param format
+     * @param index of the placeholder, advanced
+     * @param argument
+     */
+    template <bool IsFormatted, typename Format, typename T>
+    static void print_placeholder(herrlog_detail::Buffer& buffer,
+                                  const Format& format, std::size_t& index,
+                                  const T& argument) {
+        if constexpr (!herrlog_detail::is_key_value_v<T>) {
+            herrlog_detail::append_segment(buffer, format, index);
+            if constexpr (IsFormatted) {
+                herrlog_detail::append_formatted(
+                    buffer, herrlog_detail::unwrap_argument(argument),
+                    format.specs[index]);
+            } else {
+                herrlog_detail::append_argument(
+                    buffer, herrlog_detail::unwrap_argument(argument));
+            }
+            index++;
+        }
+    }
+
+    /**
+     * @brief Reads the clock source. With the system clock the timestamp is
+     * in nanoseconds since the epoch, otherwise in timestamp counter ticks.
+     *
+     * @return std::uint64_t
+     */
+    static std::uint64_t read_clock() {
+        if (clock_source.load(std::memory_order_relaxed) == ClockSource::Tsc) {
+            return herrlog_detail::TscClock::read();
+        }
+        return static_cast<std::uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count());
+    }
+
+    /**
+     * @brief Converts a timestamp returned by read_clock to wall clock time.
+     *
+     * @param timestamp
+     * @return std::chrono::system_clock::time_point
+     */
+    static std::chrono::system_clock::time_point to_time_point(
+        std::uint64_t timestamp) {
+        if (clock_source.load(std::memory_order_relaxed) == ClockSource::Tsc) {
+            return tsc_clock.to_time_point(timestamp);
+        }
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(timestamp)));
+    }
+
+    /**
+     * @brief Converts a timestamp returned by read_clock to nanoseconds since
+     * the epoch.
+     *
+     * @param timestamp
+     * @return std::uint64_t
+     */
+    static std::uint64_t to_nanoseconds(std::uint64_t timestamp) {
+        if (clock_source.load(std::memory_order_relaxed) == ClockSource::Tsc) {
+            return static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    to_time_point(timestamp).time_since_epoch())
+                    .count());
+        }
+        return timestamp;
+    }
+
+    /**
+     * @brief Get the pattern laying out text messages, see set_pattern.
+     *
+     * @return const char*
+     */
+    static const char* get_pattern() {
+        if (pattern) {
+            return pattern;
+        }
+        if (is_thread_field.load(std::memory_order_relaxed)) {
+            return is_source_location.load(std::memory_order_relaxed)
+                       ? "[%L %T %t %s:%# %f] %v"
+                       : "[%L %T %t] %v";
+        }
+        return is_source_location.load(std::memory_order_relaxed)
+                   ? "[%L %T %s:%# %f] %v"
+                   : "[%L %T] %v";
+    }
+
+    /**
+     * @brief Formats a timestamp with the datetime format, cached per thread
+     * so only the fractional seconds change within the same second.
+     *
+     * @param timestamp
+     * @return std::string_view valid until the next call on this thread
+     */
+    static std::string_view format_time(std::uint64_t timestamp) {
+        thread_local herrlog_detail::TimestampCache timestamp_cache;
+        return timestamp_cache.format(
+            to_time_point(timestamp), datetime_format,
+            datetime_format_generation.load(std::memory_order_relaxed));
+    }
+
+    /**
+     * @brief Runs the steps of a pattern layout, see set_pattern.
+     *
+     * @param buffer
+     * @param steps
+     * @param name
+     * @param timestamp
+     * @param thread
+     * @param location
+     */
+    static void print_steps(
+        herrlog_detail::Buffer& buffer,
+        std::span<const herrlog_detail::PatternLayout::Step> steps,
+        const char* name, std::uint64_t timestamp,
+        const herrlog_detail::ThreadInfo& thread,
+        const SourceLocation& location) {
+        using StepKind = herrlog_detail::PatternLayout::StepKind;
+        for (const herrlog_detail::PatternLayout::Step& step : steps) {
+            switch (step.kind) {
+                case StepKind::Literal:
+                    buffer.append(step.text);
+                    break;
+                case StepKind::Level:
+                    buffer.append(name);
+                    break;
+                case StepKind::Time:
+                    buffer.append(format_time(timestamp));
+                    break;
+                case StepKind::Thread:
+                    buffer.append(thread.text);
+                    break;
+                case StepKind::File:
+                    buffer.append(location.file);
+                    break;
+                case StepKind::Line:
+                    herrlog_detail::append_integer(buffer, location.line);
+                    break;
+                case StepKind::Function:
+                    buffer.append(location.function);
+                    break;
+                case StepKind::Message:
+                    break;
+            }
+        }
+    }
+
+    /**
+     * @brief Writes a whole message with the current encoder: the prefix, the
+     * formatted message and the fields, as text or as a JSON object.
+     *
+     * @tparam Format
+     * @tparam Args
+     * @param buffer
+     * @param name
+     * @param timestamp
+     * @param thread
+     * @param format
+     * @param args
+     * @return std::size_t size of the prefix sinks color, 0 for JSON
+     */
+    template <typename Format, typename... Args>
+    static std::size_t print_message(herrlog_detail::Buffer& buffer,
+                                     const char* name, std::uint64_t timestamp,
+                                     const herrlog_detail::ThreadInfo& thread,
+                                     const Format& format,
+                                     const Args&... args) {
+        if (encoder.load(std::memory_order_relaxed) == Encoder::Text) {
+            thread_local herrlog_detail::PatternLayout layout;
+            layout.update(get_pattern(),
+                          pattern_generation.load(std::memory_order_relaxed));
+
+            // The prefix sinks color is the head without its trailing spaces
+            const std::size_t start = buffer.size();
+            print_steps(buffer, layout.get_head(), name, timestamp, thread,
+                        format.location);
+            const std::string_view head(buffer.data() + start,
+                                        buffer.size() - start);
+            const std::size_t prefix_size =
+                head.find_last_not_of(' ') + 1;
+            if (layout.has_message()) {
+                print_to_buffer(buffer, format, args...);
+                (herrlog_detail::append_text_field(buffer, args), ...);
+                print_steps(buffer, layout.get_tail(), name, timestamp,
+                            thread, format.location);
+            }
+            return prefix_size;
+        }
+
+        const std::string_view time_string = format_time(timestamp);
+        std::string_view level(name);
+        level.remove_prefix(level.find_first_not_of(' '));
+
+        buffer.append("{\"time\":\"");
+        std::size_t start = buffer.size();
+        buffer.append(time_string);
+        herrlog_detail::escape_json(buffer, start);
+        buffer.append("\",\"level\":\"");
+        buffer.append(level);
+        if (is_thread_field.load(std::memory_order_relaxed)) {
+            buffer.append("\",\"thread\":\"");
+            start = buffer.size();
+            buffer.append(thread.text);
+            herrlog_detail::escape_json(buffer, start);
+        }
+        if (is_source_location.load(std::memory_order_relaxed)) {
+            buffer.append("\",\"file\":\"");
+            start = buffer.size();
+            buffer.append(format.location.file);
+            herrlog_detail::escape_json(buffer, start);
+            buffer.append("\",\"line\":");
+            herrlog_detail::append_integer(buffer, format.location.line);
+            buffer.append(",\"function\":\"");
+            start = buffer.size();
+            buffer.append(format.location.function);
+            herrlog_detail::escape_json(buffer, start);
+        }
+        buffer.append("\",\"message\":\"");
+        start = buffer.size();
+        print_to_buffer(buffer, format, args...);
+        herrlog_detail::escape_json(buffer, start);
+        buffer.push_back('"');
+        (herrlog_detail::append_json_field(buffer, args), ...);
+        buffer.push_back('}');
+        return 0;
+    }
+
+    /**
+     * @brief Formats a message from arguments captured by deferred
+     * formatting, called on the writer thread.
+     *
+     * @tparam Site call site, or void when a DeferredFormat was encoded
+     * @tparam Format
+     * @tparam Args
+     * @param buffer
+     * @param name
+     * @param timestamp
+     * @param thread
+     * @param arguments the DeferredFormat, unless logged from a call site,
+     * followed by the arguments
+     * @return std::size_t size of the prefix, see print_message
+     */
+    template <typename Site, typename Format, typename... Args>
+    static std::size_t print_deferred(herrlog_detail::Buffer& buffer,
+                                      const char* name,
+                                      std::uint64_t timestamp,
+                                      const herrlog_detail::ThreadInfo& thread,
+                                      const char* arguments) {
+        if constexpr (std::is_void_v<Site>) {
+            const herrlog_detail::DeferredFormat deferred_format =
+                herrlog_detail::DecodedArgument<herrlog_detail::DeferredFormat>(
+                    arguments)
+                    .get();
+            Format& format = herrlog_detail::get_checked_format<Format>(
+                deferred_format.literal);
+            // Equal literals of different calls may be merged into one
+            format.location = deferred_format.location;
+            return print_decoded<Args...>(buffer, name, timestamp, thread,
+                                          format, arguments);
+        } else {
+            return print_decoded<Args...>(
+                buffer, name, timestamp, thread,
+                herrlog_detail::site_format_v<Site, Format>, arguments);
+        }
+    }
+
+    /**
+     * @brief Decodes the arguments of a deferred message and formats it.
+     *
+     * @tparam Args
+     * @tparam Format
+     * @param buffer
+     * @param name
+     * @param timestamp
+     * @param thread
+     * @param format
+     * @param arguments
+     * @return std::size_t size of the prefix, see print_message
+     */
+    template <typename... Args, typename Format>
+    static std::size_t print_decoded(herrlog_detail::Buffer& buffer,
+                                     const char* name, std::uint64_t timestamp,
+                                     const herrlog_detail::ThreadInfo& thread,
+                                     const Format& format,
+                                     [[maybe_unused]] const char* arguments) {
+        const std::tuple<herrlog_detail::DecodedArgument<Args>...> decoded{
+            herrlog_detail::DecodedArgument<Args>(arguments)...};
+        return std::apply(
+            [&](const auto&... argument) {
+                return print_message(buffer, name, timestamp, thread, format,
+                                     argument.get()...);
+            },
+            decoded);
+    }
+
+    /**
+     * @brief The record a logging thread fills before swapping it into the
+     * asynchronous queue, reused so its buffer is not reallocated every call.
+     * The swap hands back another record, already reserved to
+     * reserved_record_size by its shard. Only the first record of a thread
+     * is grown here.
+     *
+     * @return herrlog_detail::AsyncRecord&
+     */
+    static herrlog_detail::AsyncRecord& thread_record() {
+        thread_local herrlog_detail::AsyncRecord record;
+        if (record.data.capacity() < herrlog_detail::reserved_record_size) {
+            record.data.reserve(herrlog_detail::reserved_record_size);
+        }
+        return record;
+    }
+
+    /**
+     * @brief Formatted messages handed to the sinks at once. A message is
+     * written to text, then closed with add. Records only get their text
+     * views in finish, as the text may move while it grows.
+     *
+     */
+    struct RecordBatch {
+        herrlog_detail::Buffer text;
+        std::vector<LogRecord> records;
+        std::vector<std::size_t> record_ends;
+        LogType types = LogType::None;
+
+        void clear() {
+            text.clear();
+            records.clear();
+            record_ends.clear();
+            types = LogType::None;
+        }
+
+        void add(LogType type, std::size_t prefix_size,
+                 std::string_view color) {
+            text.push_back('\n');
+            records.push_back({type, {}, prefix_size, color});
+            record_ends.push_back(text.size());
+            types = types | type;
+        }
+
+        std::span<const LogRecord> finish() {
+            std::size_t record_start = 0;
+            for (std::size_t index = 0; index < records.size(); index++) {
+                records[index].text = text.view().substr(
+                    record_start, record_ends[index] - record_start);
+                record_start = record_ends[index];
+            }
+            return records;
+        }
+    };
+
+    /**
+     * @brief Messages the calling thread gathers while a Batch is alive.
+     *
+     */
+    struct ThreadBatch {
+        std::uint32_t depth = 0;
+        RecordBatch records;
+    };
+
+    static ThreadBatch& thread_batch() {
+        thread_local ThreadBatch batch;
+        return batch;
+    }
+
+    /**
+     * @brief Writes the messages gathered by the calling thread, if any.
+     *
+     */
+    static void write_thread_batch() {
+        RecordBatch& records = thread_batch().records;
+        if (records.records.empty()) {
+            return;
+        }
+        {
+            std::lock_guard<herrlog_detail::OutputMutex> lock(
+                Logger::log_mutex);
+            write_output(records.finish(), records.types);
+        }
+        records.clear();
+    }
+
+    /**
+     * @brief Hands formatted messages to the sinks of their types and flushes
+     * them if the flush policy says so. log_mutex must be held. When logging
+     * synchronously, sinks a crash signal handler cannot flush are flushed
+     * right away, see Sink::is_flushable_from_signal. The writer thread
+     * flushes every sink itself on a crash.
+     *
+     * @param records
+     * @param types all the types of the messages
+     */
+    static void write_output(std::span<const LogRecord> records,
+                             LogType types) {
+        const bool is_flush_deferred =
+            flush_policy.every_messages != 1 && !is_async_writer_thread;
+        for (const std::shared_ptr<Sink>& sink : sinks) {
+            if ((sink->get_type() & types) && is_usable(*sink)) {
+                sink->write_batch(records);
+                if (is_flush_deferred && !sink->is_flushable_from_signal()) {
+                    sink->flush();
+                }
+            }
+        }
+        std::size_t size = 0;
+        for (const LogRecord& record : records) {
+            size += record.text.size();
+        }
+        apply_flush_policy(records.size(), size, types);
+    }
+
     /**
-     * @brief Enum defining different log types as bit flags.
+     * @brief Writes messages to the binary sink, see set_binary_sink.
+     * log_mutex must be held.
      *
+     * @param messages
+     * @param types all the types of the messages
      */
-    enum : std::uint8_t {
-        Trace = 0b000001,  // For specific details
-        Debug = 0b000010,  // Temporary debug printing
-        Info = 0b000100,  // General purpose details, e.g. "Program has started"
-        Error = 0b001000,  // For errors, exits the program
-        Warn = 0b010000,   // For reporting warning, the program keeps working
-        Fatal = 0b100000,  // Program exits and produces core dump
+    static void write_binary_output(std::span<const BinaryMessage> messages,
+                                    LogType types) {
+        std::size_t size = 0;
+        for (const BinaryMessage& message : messages) {
+            binary_sink->write(message);
+            size += message.data.size();
+        }
+        apply_flush_policy(messages.size(), size, types);
+    }
 
-        All = 0b111111,
-        None = 0b000000,
-    };
+    /**
+     * @brief Counts written messages as pending and flushes once the flush
+     * policy says so. log_mutex must be held.
+     *
+     * @param message_count
+     * @param size
+     * @param types all the types of the messages
+     */
+    static void apply_flush_policy(std::size_t message_count,
+                                   std::size_t size, LogType types) {
+        if (pending_messages == 0) {
+            first_pending_time = std::chrono::steady_clock::now();
+        }
+        pending_messages += static_cast<std::uint32_t>(message_count);
+        pending_bytes += size;
+        if ((flush_policy.every_messages != 0 &&
+             pending_messages >= flush_policy.every_messages) ||
+            (flush_policy.every_bytes != 0 &&
+             pending_bytes >= flush_policy.every_bytes) ||
+            (flush_policy.on_types & types) || is_flush_interval_over()) {
+            flush_output();
+        }
+    }
 
     /**
-     * @brief Construct a new Log Type object. Allows implicit conversion from
-     * uint8_t. Thus allows assignments like LogType Logger::log_type =
-     * LogType::All;
+     * @brief Checks whether pending messages have waited longer than the
+     * flush interval. log_mutex must be held.
      *
-     * @param initial_flag
+     * @return true if the output should be flushed
+     * @return false otherwise
      */
-    LogType(std::uint8_t initial_flag) : bitflag(initial_flag) {}
+    static bool is_flush_interval_over() {
+        return flush_policy.interval.count() != 0 && pending_messages != 0 &&
+               std::chrono::steady_clock::now() - first_pending_time >=
+                   flush_policy.interval;
+    }
 
     /**
-     * @brief Overloading the `|` operator for combining log types.
-     * @param other
-     * @return LogType
+     * @brief Flushes every sink. log_mutex must be held.
+     *
+     * @param is_sync whether it is an explicit flush, see Sink::sync
      */
-    LogType operator|(const LogType other) const {
-        return LogType((static_cast<std::uint8_t>(bitflag) |
-                        static_cast<std::uint8_t>(other.bitflag)));
+    static void flush_output(bool is_sync = false) {
+        for (const std::shared_ptr<Sink>& sink : sinks) {
+            if (!is_usable(*sink)) {
+                continue;
+            }
+            if (is_sync) {
+                sink->sync();
+            } else {
+                sink->flush();
+            }
+        }
+        if (binary_sink) {
+            binary_sink->flush();
+        }
+        pending_messages = 0;
+        pending_bytes = 0;
     }
 
     /**
-     * @brief Overloading the `&` operator for checking if a log type is set.
+     * @brief Writes out whatever is pending when std::terminate is called.
+     * Does not wait more than a second for the writer thread, and gives up
+     * on flushing if the output is locked, e.g. by the terminating thread.
      *
-     * @param other
-     * @return true if the bit is set in both operands
-     * @return false otherwise
      */
-    bool operator&(const LogType other) const {
-        return static_cast<bool>(static_cast<std::uint8_t>(bitflag) &
-                                 static_cast<std::uint8_t>(other.bitflag));
+    static void flush_on_terminate() {
+        if (async_queue && std::this_thread::get_id() != async_writer.get_id()) {
+            async_queue->wait_until_drained(std::chrono::steady_clock::now() +
+                                            std::chrono::seconds(1));
+        }
+        std::unique_lock<herrlog_detail::OutputMutex> lock(Logger::log_mutex,
+                                                           std::try_to_lock);
+        if (lock.owns_lock()) {
+            flush_output();
+        }
     }
-};
 
-/**
- * @brief Logger implementation providing flexible logging capabilities.
- *
- */
-class Logger {
-   private:
-    static LogType log_type;
-    static std::string output_file_name;
-    static std::ostream* output_buffer;
-    static bool is_color_output;
-    static const char* datetime_format;
-    static std::mutex log_mutex;
-    static std::ofstream output_file;
+    /**
+     * @brief Writes out whatever is pending from a crash signal handler,
+     * where the crashing thread may hold any lock and streams are not safe
+     * to use. It only uses lock-free atomics, nanosleep and write(2). The
+     * writer thread, if there is one, is asked with an atomic to drain the
+     * queue and flush, which it does within its idle timeout. The handler
+     * waits for it about a second at most. Then, unless the output is
+     * locked, every sink and the binary sink write what they still buffer,
+     * see Sink::flush_from_signal and OutputMutex.
+     *
+     */
+    static void flush_on_signal() {
+        if (is_async_running.load() && !is_async_writer_thread) {
+            const std::uint64_t request = signal_flush_requests.fetch_add(1) + 1;
+            for (int wait = 0; wait < 1000 && signal_flushes.load() < request;
+                 wait++) {
+                herrlog_detail::sleep_from_signal();
+            }
+        }
+        if (Logger::log_mutex.try_lock_from_signal()) {
+            for (const std::shared_ptr<Sink>& sink : sinks) {
+                sink->flush_from_signal();
+            }
+            if (binary_sink) {
+                binary_sink->flush_from_signal();
+            }
+            Logger::log_mutex.unlock_from_signal();
+        }
+    }
 
     /**
-     * @brief A recursive function to print the templated arguments passed
+     * @brief Handler of crashing signals, flushes then lets the previous
+     * handler (by default terminating the program) deal with the signal.
      *
-     * @tparam T
-     * @tparam Rest
-     * @param stream
-     * @param format
-     * @param arg
-     * @param rest
+     * @param signal_number
      */
-    template <typename T, typename... Rest>
-    static void print_to_stream(std::ostream& stream, const char* format, T arg,
-                                Rest... rest) {
-        for (size_t index = 0; format[index] != '\0'; index++) {
-            if (format[index] == '{' && format[index + 1] == '}') {
-                stream << arg;
-                return print_to_stream(stream, format + index + 2, rest...);
+    static void handle_crash_signal(int signal_number) {
+        flush_on_signal();
+        SignalHandler previous_handler = SIG_DFL;
+        for (std::size_t index = 0; index < std::size(crash_signals); index++) {
+            if (crash_signals[index] == signal_number &&
+                previous_signal_handlers[index] != SIG_ERR) {
+                previous_handler = previous_signal_handlers[index];
             }
-            stream << format[index];
         }
+        std::signal(signal_number, previous_handler);
+        std::raise(signal_number);
     }
 
     /**
-     * @brief Base case for the recursive function
+     * @brief Installs the handlers flushing pending messages on crashes and
+     * std::terminate, once.
      *
-     * @param stream
+     */
+    static void install_crash_handlers() {
+        if (is_crash_handler_installed.exchange(true)) {
+            return;
+        }
+        for (std::size_t index = 0; index < std::size(crash_signals); index++) {
+            previous_signal_handlers[index] =
+                std::signal(crash_signals[index], handle_crash_signal);
+        }
+        previous_terminate_handler = std::set_terminate([] {
+            flush_on_terminate();
+            if (previous_terminate_handler) {
+                previous_terminate_handler();
+            }
+            std::abort();
+        });
+    }
+
+    /**
+     * @brief Logs a message of the given type if it is enabled, with the
+     * name and color of the type. Error then exits the program, fatal aborts
+     * it.
+     *
+     * @tparam Type
+     * @tparam Site call site, see log_at, or void
+     * @tparam Format
+     * @tparam Args
      * @param format
+     * @param args
      */
-    static void print_to_stream(std::ostream& stream, const char* format) {
-        for (size_t index = 0; format[index] != '\0'; index++) {
-            stream << format[index];
+    template <std::uint8_t Type, typename Site = void, typename Format,
+              typename... Args>
+    static void log_level(const Format& format, const Args&... args) {
+        if constexpr (HERRLOG_ACTIVE_LEVELS & Type) {
+            if (log_type & Type) {
+                if constexpr (Type == LogType::Trace) {
+                    log<Site>(Type, "TRACE", ascii_colors::bold_white_color,
+                              format, args...);
+                } else if constexpr (Type == LogType::Debug) {
+                    log<Site>(Type, "DEBUG", ascii_colors::bold_blue_color,
+                              format, args...);
+                } else if constexpr (Type == LogType::Info) {
+                    log<Site>(Type, " INFO", ascii_colors::bold_green_color,
+                              format, args...);
+                } else if constexpr (Type == LogType::Error) {
+                    log<Site>(Type, "ERROR", ascii_colors::bold_red_color,
+                              format, args...);
+                    flush();
+                    exit(EXIT_FAILURE);
+                } else if constexpr (Type == LogType::Warn) {
+                    log<Site>(Type, " WARN", ascii_colors::bold_yellow_color,
+                              format, args...);
+                } else {
+                    static_assert(Type == LogType::Fatal, "Unknown log type");
+                    log<Site>(Type, "FATAL",
+                              ascii_colors::background_red_color, format,
+                              args...);
+                    flush();
+                    abort();
+                }
+            }
         }
     }
 
     /**
      * @brief Logs a message with specified details to the console or a file.
      *
+     * @tparam Site call site, see log_at, or void
+     * @tparam Format
      * @tparam Args
+     * @param type
      * @param name
      * @param color
      * @param format
      * @param args
      */
-    template <typename... Args>
-    static void log(const char* name, const std::string_view& color,
-                    const char* format, Args... args) {
-        std::time_t current_time = std::chrono::system_clock::to_time_t(
-            std::chrono::system_clock::now());
-        char time_string[100];
-        std::strftime(time_string, sizeof(time_string), datetime_format,
-                      std::localtime(&current_time));
+    template <typename Site = void, typename Format, typename... Args>
+    static void log(LogType type, const char* name,
+                    const std::string_view& color, const Format& format,
+                    const Args&... args) {
+        if (is_binary_output.load(std::memory_order_relaxed)) {
+            log_binary<Site>(type, format, args...);
+            return;
+        }
+        if constexpr ((herrlog_detail::is_deferrable_v<
+                           herrlog_detail::deferred_t<Args>> &&
+                       ...)) {
+            if (async_queue &&
+                is_deferred_formatting.load(std::memory_order_relaxed)) {
+                herrlog_detail::AsyncRecord& record = thread_record();
+                record.data.clear();
+                if constexpr (std::is_void_v<Site>) {
+                    herrlog_detail::encode_argument(
+                        record.data, herrlog_detail::DeferredFormat{
+                                         format.literal, format.location});
+                }
+                (herrlog_detail::encode_deferred(record.data, args), ...);
+                record.name = name;
+                record.color = color;
+                record.type = type;
+                record.binary_format = nullptr;
+                record.format_message =
+                    &print_deferred<Site, Format,
+                                    herrlog_detail::deferred_t<Args>...>;
+                const herrlog_detail::ThreadInfo& thread =
+                    herrlog_detail::current_thread();
+                record.data.append(thread.text);
+                record.timestamp = read_clock();
+                record.thread_id = thread.id;
+                record.thread_text_size = thread.text.size();
+                async_queue->push(
+                    record, overflow_policy.load(std::memory_order_relaxed));
+                return;
+            }
+        }
+
+        const std::uint64_t timestamp = read_clock();
+        herrlog_detail::ThreadBuffer buffer;
+        const std::size_t prefix_size =
+            print_message(*buffer, name, timestamp,
+                          herrlog_detail::current_thread(), format, args...);
+
+        if (async_queue) {
+            herrlog_detail::AsyncRecord& record = thread_record();
+            record.data.assign(buffer->data(), buffer->size());
+            record.color = color;
+            record.type = type;
+            record.prefix_size = prefix_size;
+            record.timestamp = timestamp;
+            record.format_message = nullptr;
+            record.binary_format = nullptr;
+            async_queue->push(record,
+                              overflow_policy.load(std::memory_order_relaxed));
+            return;
+        }
+
+        ThreadBatch& batch = thread_batch();
+        if (batch.depth != 0) {
+            batch.records.text.append(buffer->view());
+            batch.records.add(type, prefix_size, color);
+            if (batch.records.text.size() >= max_batch_size) {
+                write_thread_batch();
+            }
+            return;
+        }
+
+        buffer->push_back('\n');
+        const LogRecord record{type, buffer->view(), prefix_size, color};
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        write_output(std::span<const LogRecord>(&record, 1), type);
+    }
+
+    /**
+     * @brief Logs a message in the binary format, see set_binary_sink. Only
+     * the pointer to the format literal, unless logged from a call site, and
+     * the raw arguments are copied. Nothing is formatted except arguments
+     * printed with operator<<.
+     *
+     * @tparam Site
+     * @tparam Format
+     * @tparam Args
+     * @param type
+     * @param format
+     * @param args
+     */
+    template <typename Site, typename Format, typename... Args>
+    static void log_binary(LogType type, const Format& format,
+                           const Args&... args) {
+        const std::uint64_t timestamp = read_clock();
+        const herrlog_detail::BinaryFormat& binary_format =
+            herrlog_detail::binary_format_v<
+                Site, Format, herrlog_detail::unwrapped_t<Args>...>;
+        herrlog_detail::ThreadBuffer buffer;
+        if constexpr (std::is_void_v<Site>) {
+            buffer->append(
+                std::string_view(reinterpret_cast<const char*>(&format.literal),
+                                 sizeof(format.literal)));
+        }
+        (herrlog_detail::append_binary_argument(
+             *buffer, herrlog_detail::unwrap_argument(args)),
+         ...);
 
-        std::stringstream ss;
-        ss << (is_color_output ? color : std::string_view()) << "[" << name
-           << " " << time_string << "]"
-           << (is_color_output ? ascii_colors::reset_color : std::string_view())
-           << " ";
+        if (async_queue) {
+            herrlog_detail::AsyncRecord& record = thread_record();
+            record.data.assign(buffer->data(), buffer->size());
+            record.type = type;
+            record.timestamp = timestamp;
+            record.format_message = nullptr;
+            record.binary_format = &binary_format;
+            async_queue->push(record,
+                              overflow_policy.load(std::memory_order_relaxed));
+            return;
+        }
 
-        print_to_stream(ss, format, args...);
+        const BinaryMessage message{type, to_nanoseconds(timestamp),
+                                    &binary_format, buffer->view()};
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        if (binary_sink) {
+            write_binary_output(std::span<const BinaryMessage>(&message, 1),
+                                type);
+        }
+    }
 
-        std::lock_guard<std::mutex> lock(Logger::log_mutex);
-        *output_buffer << ss.str() << '\n';
-        /**
-         * @brief Ideally buffer shouldn't be flushed every time, but if we
-         * don't do it and the program prematurely crashes, all the logs will be
-         * lost
-         *
-         */
-        output_buffer->flush();
+    /**
+     * @brief Body of the writer thread of the asynchronous backend. Formats
+     * queued messages in batches, each batch is written at once. While idle
+     * it still wakes up to apply the flush interval.
+     *
+     */
+    static void run_async_writer() {
+        is_async_writer_thread = true;
+        std::vector<herrlog_detail::AsyncRecord> batch;
+        RecordBatch log_records;
+        std::vector<BinaryMessage> binary_messages;
+        for (;;) {
+            const bool is_stopping = is_async_stopping.load();
+            const bool has_written = async_queue->drain(
+                batch, [&](std::span<herrlog_detail::AsyncRecord> records) {
+                    log_records.clear();
+                    binary_messages.clear();
+                    LogType binary_types = LogType::None;
+                    for (const herrlog_detail::AsyncRecord& record : records) {
+                        if (record.binary_format) {
+                            binary_messages.push_back(
+                                {record.type, to_nanoseconds(record.timestamp),
+                                 record.binary_format, record.data});
+                            binary_types = binary_types | record.type;
+                            continue;
+                        }
+                        std::size_t prefix_size = record.prefix_size;
+                        if (record.format_message) {
+                            const std::string_view data(record.data);
+                            const herrlog_detail::ThreadInfo thread{
+                                record.thread_id,
+                                data.substr(data.size() -
+                                            record.thread_text_size)};
+                            prefix_size = record.format_message(
+                                log_records.text, record.name,
+                                record.timestamp, thread, data.data());
+                        } else {
+                            log_records.text.append(record.data);
+                        }
+                        log_records.add(record.type, prefix_size,
+                                        record.color);
+                    }
+                    std::lock_guard<herrlog_detail::OutputMutex> lock(
+                        Logger::log_mutex);
+                    if (!log_records.records.empty()) {
+                        write_output(log_records.finish(), log_records.types);
+                    }
+                    if (!binary_messages.empty() && binary_sink) {
+                        write_binary_output(binary_messages, binary_types);
+                    }
+                });
+            if (!has_written) {
+                if (is_stopping) {
+                    return;
+                }
+                std::chrono::milliseconds timeout(100);
+                {
+                    std::lock_guard<herrlog_detail::OutputMutex> lock(
+                        Logger::log_mutex);
+                    // Everything queued is written, see flush_on_signal
+                    const std::uint64_t signal_flush_request =
+                        signal_flush_requests.load();
+                    if (is_flush_interval_over() ||
+                        signal_flush_request != signal_flushes.load()) {
+                        flush_output();
+                        signal_flushes.store(signal_flush_request);
+                    }
+                    if (flush_policy.interval.count() != 0) {
+                        timeout = std::min(timeout, flush_policy.interval);
+                    }
+                }
+                async_queue->wait_for_messages(timeout);
+            }
+        }
     }
 
     /**
@@ -215,53 +6034,351 @@ class Logger {
     static void set_type(LogType log_type) { Logger::log_type = log_type; }
 
     /**
-     * @brief Set the output file name object
+     * @brief Set the output file name object. The file is opened before the
+     * default sink is switched to it, other threads and the writer thread
+     * keep logging to the previous output meanwhile. If it cannot be opened
+     * a warning is logged and the output stays as it was.
      *
      * @param output_file_name
      */
     static void set_output_file_name(std::string output_file_name) {
-        Logger::output_file_name = output_file_name;
-        Logger::output_file = std::ofstream(Logger::output_file_name);
-        if (Logger::output_file.is_open()) {
-            Logger::output_file.close();
-        }
-        Logger::output_file.open(Logger::output_file_name);
-        if (!Logger::output_file.is_open()) {
-            Logger::error(
-                "Failed to open {}",
-                Logger::output_file_name);  // Peak efficiency ᕦ(ò_óˇ)ᕤ
+        auto file =
+            std::make_unique<herrlog_detail::FileWriter>(output_file_name);
+        if (!file->is_open()) {
+            Logger::warn("Failed to open {}",
+                         output_file_name);  // Peak efficiency ᕦ(ò_óˇ)ᕤ
             return;
         }
 
-        output_buffer = &Logger::output_file;
-        is_color_output = false;
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        Logger::output_file_name = std::move(output_file_name);
+        default_sink->set_file(std::move(file));
+        default_sink->set_is_color_output(false);
     }
 
     /**
-     * @brief Set the datetime format object, default is "%Y-%m-%d %H:%M:%S"
+     * @brief Set the datetime format object, default is "%Y-%m-%d %H:%M:%S".
+     * On top of the strftime specifiers, %3N, %6N and %9N (or %N) print the
+     * milliseconds, microseconds and nanoseconds within the second.
      *
      * @param datetime_format
      */
     static void set_datetime_format(const char* datetime_format) {
         Logger::datetime_format = datetime_format;
+        datetime_format_generation.fetch_add(1);
+    }
+
+    /**
+     * @brief Set the clock read when a message is logged, default is
+     * ClockSource::System. ClockSource::Tsc reads the CPU timestamp counter
+     * instead, which is cheaper, and converts it to wall clock time only when
+     * the message is rendered. Enabling it calibrates the counter, which
+     * blocks for about 10 milliseconds. Messages still queued are written
+     * before switching.
+     *
+     * @param clock_source
+     */
+    static void set_clock_source(ClockSource clock_source) {
+        flush();
+        if (clock_source == ClockSource::Tsc) {
+            tsc_clock.calibrate();
+        }
+        Logger::clock_source.store(clock_source);
+    }
+
+    /**
+     * @brief Set how messages are written out, default is Encoder::Text.
+     * With Encoder::JsonLines every message is a JSON object on its own line,
+     * with the time, level, message and fields as members. Messages still
+     * queued are written before switching.
+     *
+     * @param encoder
+     */
+    static void set_encoder(Encoder encoder) {
+        flush();
+        Logger::encoder.store(encoder);
     }
 
     /**
-     * @brief Set the output buffer object
+     * @brief Set the output buffer object of the default sink
      *
      * @param output_buffer
      */
     static void set_output_buffer(std::ostream& output_buffer) {
-        Logger::output_buffer = &output_buffer;
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        default_sink->set_stream(output_buffer);
     }
 
     /**
-     * @brief Set the is color output object
+     * @brief Set the is color output object of the default sink
      *
      * @param is_color_output
      */
     static void set_is_color_output(bool is_color_output) {
-        Logger::is_color_output = is_color_output;
+        default_sink->set_is_color_output(is_color_output);
+    }
+
+    /**
+     * @brief Get the default sink, writing to std::cout with colors unless
+     * changed with set_output_buffer, set_output_file_name and
+     * set_is_color_output.
+     *
+     * @return std::shared_ptr<StreamSink>
+     */
+    static std::shared_ptr<StreamSink> get_default_sink() {
+        return default_sink;
+    }
+
+    /**
+     * @brief Adds a sink, every message is formatted once and written to all
+     * the sinks of its type.
+     *
+     * @param sink
+     */
+    static void add_sink(std::shared_ptr<Sink> sink) {
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        sinks.push_back(std::move(sink));
+    }
+
+    /**
+     * @brief Removes a sink, flushing it first. Also works for the default
+     * sink.
+     *
+     * @param sink
+     */
+    static void remove_sink(const std::shared_ptr<Sink>& sink) {
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        std::erase_if(sinks, [&](const std::shared_ptr<Sink>& added_sink) {
+            if (added_sink != sink) {
+                return false;
+            }
+            added_sink->flush();
+            return true;
+        });
+    }
+
+    /**
+     * @brief Writes messages in a compact binary format to the given sink
+     * instead of formatting them for the other sinks, which get nothing
+     * while it is set. Passing nullptr goes back to text. Messages still
+     * queued are written before switching.
+     *
+     * @param sink
+     */
+    static void set_binary_sink(std::shared_ptr<BinaryFileSink> sink) {
+        flush();
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        if (binary_sink) {
+            binary_sink->flush();
+        }
+        is_binary_output.store(sink != nullptr);
+        binary_sink = std::move(sink);
+    }
+
+    /**
+     * @brief Switches between synchronous logging (the default) and the
+     * asynchronous backend. In asynchronous mode messages are formatted on the
+     * calling thread and queued, a dedicated writer thread writes them to the
+     * output buffer. Every logging thread has its own queue, the writer
+     * merges them in timestamp order. Disabling it writes everything still
+     * queued first. Enabling it installs the handlers flushing the queue on
+     * crashes, see FlushPolicy. Should not be called while other threads are
+     * logging.
+     *
+     * @param is_async
+     * @param queue_capacity maximum number of queued messages per logging
+     * thread, rounded up to a power of two
+     */
+    static void set_async(bool is_async, std::size_t queue_capacity = 1024) {
+        if (async_queue) {
+            is_async_running.store(false);
+            is_async_stopping.store(true);
+            async_queue->wake();
+            async_writer.join();
+            async_queue.reset();
+            is_async_stopping.store(false);
+        }
+        if (is_async) {
+            async_queue =
+                std::make_unique<herrlog_detail::AsyncQueue>(queue_capacity);
+            async_writer = std::thread(run_async_writer);
+            is_async_running.store(true);
+            // Queued messages are pending whatever the flush policy
+            install_crash_handlers();
+        }
+    }
+
+    /**
+     * @brief Set the overflow policy of the asynchronous backend, default is
+     * OverflowPolicy::Block
+     *
+     * @param overflow_policy
+     */
+    static void set_overflow_policy(OverflowPolicy overflow_policy) {
+        Logger::overflow_policy.store(overflow_policy);
+    }
+
+    /**
+     * @brief Set whether the asynchronous backend defers formatting to the
+     * writer thread, default is false. When enabled, messages whose arguments
+     * are arithmetic, strings or trivially copyable are captured as raw bytes
+     * and formatted by the writer thread, other messages are still formatted
+     * on the calling thread.
+     *
+     * @param is_deferred_formatting
+     */
+    static void set_is_deferred_formatting(bool is_deferred_formatting) {
+        Logger::is_deferred_formatting.store(is_deferred_formatting);
+    }
+
+    /**
+     * @brief Set whether messages show where they were logged from, as
+     * "file:line function" after the time, default is false. The location is
+     * captured at compile time by every call, so showing it costs no more
+     * than copying the strings.
+     *
+     * @param is_source_location
+     */
+    static void set_is_source_location(bool is_source_location) {
+        flush();
+        Logger::is_source_location.store(is_source_location);
+        pattern_generation.fetch_add(1);
+    }
+
+    /**
+     * @brief Set whether messages show the thread they were logged from, as
+     * its name or else its ID after the time, default is false. With JSON
+     * Lines it is the "thread" member. The text of a thread is rendered once,
+     * see set_thread_name.
+     *
+     * @param is_thread_field
+     */
+    static void set_is_thread_field(bool is_thread_field) {
+        flush();
+        Logger::is_thread_field.store(is_thread_field);
+        pattern_generation.fetch_add(1);
+    }
+
+    /**
+     * @brief Set the name of the calling thread, shown instead of its ID by
+     * the thread field and by %t in patterns. Every thread keeps only its
+     * current name, messages still queued keep the name they were logged
+     * with.
+     *
+     * @param name
+     */
+    static void set_thread_name(std::string_view name) {
+        herrlog_detail::current_thread_state().set_text(name);
+    }
+
+    /**
+     * @brief Set the pattern laying out text messages, default is
+     * "[%L %T] %v", or "[%L %T %s:%# %f] %v" with source locations, with
+     * " %t" after the time when the thread field is shown. The
+     * pattern is compiled once by every formatting thread, so changing it
+     * costs nothing per call. The string must outlive its use, and nullptr
+     * restores the default.
+     *
+     * Specifiers: %L level, %T time in the datetime format, %t thread name
+     * or ID, %s source file, %# line, %f function, %v message with its
+     * fields and %% a percent sign. Sinks color the part before the message,
+     * without its trailing spaces.
+     *
+     * @param pattern
+     */
+    static void set_pattern(const char* pattern) {
+        flush();
+        Logger::pattern = pattern;
+        pattern_generation.fetch_add(1);
+    }
+
+    /**
+     * @brief Get the number of messages discarded by the overflow policy since
+     * the asynchronous backend was enabled.
+     *
+     * @return std::uint64_t
+     */
+    static std::uint64_t get_dropped_count() {
+        return async_queue ? async_queue->get_dropped_count() : 0;
+    }
+
+    /**
+     * @brief Blocks until every message logged before the call has been
+     * written, then flushes the sinks, waiting for the disk where a sink can,
+     * see Sink::sync.
+     *
+     */
+    static void flush() {
+        write_thread_batch();
+        if (async_queue) {
+            async_queue->wait_until_drained();
+        }
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        flush_output(true);
+    }
+
+    /**
+     * @brief Stops the asynchronous backend, writing everything still
+     * queued, and flushes every sink. At exit only sinks safe at exit are
+     * written and flushed (files, file descriptors, memory and the standard
+     * streams, see Sink::is_safe_at_exit), so call it before main returns
+     * when a sink writes to a stream the program owns, e.g. one passed to
+     * set_output_buffer. Messages logged afterwards are written
+     * synchronously.
+     *
+     */
+    static void shutdown() {
+        write_thread_batch();
+        set_async(false);
+        std::lock_guard<herrlog_detail::OutputMutex> lock(Logger::log_mutex);
+        flush_output(true);
+    }
+
+    /**
+     * @brief Gathers the messages the calling thread logs while it is alive
+     * and hands them to the sinks at once when it ends, e.g. for bursts of
+     * error lines. Batches nest, the outermost one writes. Flush and error
+     * also write what the thread gathered. Has no effect in asynchronous
+     * mode, where the writer thread batches messages anyway, nor on binary
+     * output.
+     *
+     */
+    class [[nodiscard]] Batch {
+       public:
+        Batch() { thread_batch().depth++; }
+
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+
+        ~Batch() {
+            if (--thread_batch().depth == 0) {
+                write_thread_batch();
+            }
+        }
+    };
+
+    /**
+     * @brief Starts a Batch that lasts until the returned object goes out of
+     * scope.
+     *
+     * @return Batch
+     */
+    static Batch batch() { return Batch(); }
+
+    /**
+     * @brief Set the flush policy, default flushes after every message.
+     *
+     * @param flush_policy
+     */
+    static void set_flush_policy(const FlushPolicy& flush_policy) {
+        {
+            std::lock_guard<herrlog_detail::OutputMutex> lock(
+                Logger::log_mutex);
+            Logger::flush_policy = flush_policy;
+        }
+        if (flush_policy.every_messages != 1) {
+            install_crash_handlers();
+        }
     }
 
     /**
@@ -274,10 +6391,9 @@ class Logger {
      * @param args
      */
     template <typename... Args>
-    static void trace(const char* format, Args... args) {
-        if (log_type & LogType::Trace) {
-            log("TRACE", ascii_colors::bold_white_color, format, args...);
-        }
+    static void trace(FormatString<std::type_identity_t<Args>...> format,
+                      const Args&... args) {
+        log_level<LogType::Trace>(format, args...);
     }
 
     /**
@@ -290,10 +6406,9 @@ class Logger {
      * @param args
      */
     template <typename... Args>
-    static void debug(const char* format, Args... args) {
-        if (log_type & LogType::Debug) {
-            log("DEBUG", ascii_colors::bold_blue_color, format, args...);
-        }
+    static void debug(FormatString<std::type_identity_t<Args>...> format,
+                      const Args&... args) {
+        log_level<LogType::Debug>(format, args...);
     }
 
     /**
@@ -306,11 +6421,9 @@ class Logger {
      * @param args
      */
     template <typename... Args>
-    static void info(const char* format, Args... args) {
-        if (log_type & LogType::Info) {
-            std::this_thread::sleep_for(std::chrono::seconds(1));
-            log(" INFO", ascii_colors::bold_green_color, format, args...);
-        }
+    static void info(FormatString<std::type_identity_t<Args>...> format,
+                     const Args&... args) {
+        log_level<LogType::Info>(format, args...);
     }
 
     /**
@@ -324,11 +6437,9 @@ class Logger {
      * @param args
      */
     template <typename... Args>
-    static void error(const char* format, Args... args) {
-        if (log_type & LogType::Error) {
-            log("ERROR", ascii_colors::bold_red_color, format, args...);
-            exit(EXIT_FAILURE);
-        }
+    static void error(FormatString<std::type_identity_t<Args>...> format,
+                      const Args&... args) {
+        log_level<LogType::Error>(format, args...);
     }
 
     /**
@@ -340,10 +6451,9 @@ class Logger {
      * @param args
      */
     template <typename... Args>
-    static void warn(const char* format, Args... args) {
-        if (log_type & LogType::Warn) {
-            log(" WARN", ascii_colors::bold_yellow_color, format, args...);
-        }
+    static void warn(FormatString<std::type_identity_t<Args>...> format,
+                     const Args&... args) {
+        log_level<LogType::Warn>(format, args...);
     }
 
     /**
@@ -355,21 +6465,147 @@ class Logger {
      * @param args
      */
     template <typename... Args>
-    static void fatal(const char* format, Args... args) {
-        if (log_type & LogType::Fatal) {
-            log("FATAL", ascii_colors::background_red_color, format, args...);
-            abort();
+    static void fatal(FormatString<std::type_identity_t<Args>...> format,
+                      const Args&... args) {
+        log_level<LogType::Fatal>(format, args...);
+    }
+
+    /**
+     * @brief Logs a message from a call site, what the HERRLOG_* macros
+     * expand to. The format string is a constant of the call site, so
+     * deferred and binary messages refer to it instead of copying it.
+     *
+     * @tparam Site type of a lambda returning the CallSite, see
+     * HERRLOG_CALL_SITE
+     * @tparam Args
+     * @param args
+     */
+    template <typename Site, typename... Args>
+    static void log_at(const Args&... args) {
+        constexpr CallSite call_site = Site{}();
+        log_level<call_site.type, Site>(
+            herrlog_detail::site_format_v<Site, FormatString<Args...>>,
+            args...);
+    }
+
+    /**
+     * @brief Get every call site of the HERRLOG_* macros in the program,
+     * whose ID is its index plus 1. They are registered before main runs.
+     *
+     * @return std::vector<CallSite>
+     */
+    static std::vector<CallSite> get_call_sites() {
+        return herrlog_detail::CallSiteRegistry::get_all();
+    }
+
+    /**
+     * @brief Writes every call site as a line "id type file:line format",
+     * the type being its LogType bit, e.g. for decoders of the binary format.
+     *
+     * @param stream
+     */
+    static void dump_call_sites(std::ostream& stream) {
+        const std::vector<CallSite> call_sites = get_call_sites();
+        for (std::size_t index = 0; index < call_sites.size(); index++) {
+            const CallSite& call_site = call_sites[index];
+            stream << index + 1 << ' '
+                   << static_cast<unsigned>(call_site.type) << ' '
+                   << call_site.location.file << ':' << call_site.location.line
+                   << ' ' << call_site.format << '\n';
         }
     }
 };
 
+/**
+ * @brief The type of a lambda returning the CallSite it expands in, unique to
+ * every expansion. Used by the HERRLOG_* macros, see Logger::log_at.
+ *
+ */
+#define HERRLOG_CALL_SITE(type, format)                                      \
+    decltype([] {                                                            \
+        return CallSite{type, format, std::source_location::current()};      \
+    })
+
+/**
+ * @brief Macros logging a message of the log type of the same name, if it is
+ * in HERRLOG_ACTIVE_LEVELS. Otherwise they expand to nothing, so the
+ * arguments are not evaluated either. Every macro is a registered call site,
+ * see Logger::get_call_sites.
+ *
+ */
+#if (HERRLOG_ACTIVE_LEVELS) & 0b000001
+#define HERRLOG_TRACE(format, ...)                                           \
+    Logger::log_at<HERRLOG_CALL_SITE(LogType::Trace, format)>(__VA_ARGS__)
+#else
+#define HERRLOG_TRACE(...) static_cast<void>(0)
+#endif
+#if (HERRLOG_ACTIVE_LEVELS) & 0b000010
+#define HERRLOG_DEBUG(format, ...)                                           \
+    Logger::log_at<HERRLOG_CALL_SITE(LogType::Debug, format)>(__VA_ARGS__)
+#else
+#define HERRLOG_DEBUG(...) static_cast<void>(0)
+#endif
+#if (HERRLOG_ACTIVE_LEVELS) & 0b000100
+#define HERRLOG_INFO(format, ...)                                            \
+    Logger::log_at<HERRLOG_CALL_SITE(LogType::Info, format)>(__VA_ARGS__)
+#else
+#define HERRLOG_INFO(...) static_cast<void>(0)
+#endif
+#if (HERRLOG_ACTIVE_LEVELS) & 0b001000
+#define HERRLOG_ERROR(format, ...)                                           \
+    Logger::log_at<HERRLOG_CALL_SITE(LogType::Error, format)>(__VA_ARGS__)
+#else
+#define HERRLOG_ERROR(...) static_cast<void>(0)
+#endif
+#if (HERRLOG_ACTIVE_LEVELS) & 0b010000
+#define HERRLOG_WARN(format, ...)                                            \
+    Logger::log_at<HERRLOG_CALL_SITE(LogType::Warn, format)>(__VA_ARGS__)
+#else
+#define HERRLOG_WARN(...) static_cast<void>(0)
+#endif
+#if (HERRLOG_ACTIVE_LEVELS) & 0b100000
+#define HERRLOG_FATAL(format, ...)                                           \
+    Logger::log_at<HERRLOG_CALL_SITE(LogType::Fatal, format)>(__VA_ARGS__)
+#else
+#define HERRLOG_FATAL(...) static_cast<void>(0)
+#endif
+
 LogType Logger::log_type = LogType::All;
 std::string Logger::output_file_name = std::string();
-std::ostream* Logger::output_buffer = &std::cout;
-bool Logger::is_color_output = true;
+std::shared_ptr<StreamSink> Logger::default_sink =
+    std::make_shared<StreamSink>(std::cout, true);
+std::vector<std::shared_ptr<Sink>> Logger::sinks = {Logger::default_sink};
 const char* Logger::datetime_format = "%Y-%m-%d %H:%M:%S";
-std::mutex Logger::log_mutex;
-std::ofstream Logger::output_file = std::ofstream();
+std::atomic<std::uint64_t> Logger::datetime_format_generation = 1;
+std::atomic<ClockSource> Logger::clock_source = ClockSource::System;
+std::atomic<Encoder> Logger::encoder = Encoder::Text;
+std::shared_ptr<BinaryFileSink> Logger::binary_sink;
+std::atomic<bool> Logger::is_binary_output = false;
+herrlog_detail::TscClock Logger::tsc_clock;
+herrlog_detail::OutputMutex Logger::log_mutex;
+std::unique_ptr<herrlog_detail::AsyncQueue> Logger::async_queue;
+std::thread Logger::async_writer;
+std::atomic<bool> Logger::is_async_stopping = false;
+std::atomic<bool> Logger::is_async_running = false;
+thread_local bool Logger::is_async_writer_thread = false;
+std::atomic<OverflowPolicy> Logger::overflow_policy = OverflowPolicy::Block;
+std::atomic<bool> Logger::is_deferred_formatting = false;
+std::atomic<bool> Logger::is_source_location = false;
+std::atomic<bool> Logger::is_thread_field = false;
+const char* Logger::pattern = nullptr;
+std::atomic<std::uint64_t> Logger::pattern_generation = 1;
+FlushPolicy Logger::flush_policy = FlushPolicy();
+std::uint32_t Logger::pending_messages = 0;
+std::size_t Logger::pending_bytes = 0;
+std::chrono::steady_clock::time_point Logger::first_pending_time;
+std::atomic<bool> Logger::is_crash_handler_installed = false;
+std::atomic<bool> Logger::is_exiting = false;
+std::terminate_handler Logger::previous_terminate_handler = nullptr;
+std::atomic<std::uint64_t> Logger::signal_flush_requests = 0;
+std::atomic<std::uint64_t> Logger::signal_flushes = 0;
+Logger::SignalHandler
+    Logger::previous_signal_handlers[std::size(Logger::crash_signals)];
+Logger::Shutdown Logger::shutdown_at_exit;
 
 /**
  * Special Thanks to:
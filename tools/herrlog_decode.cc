@@ -0,0 +1,333 @@
+/**
+ * @file herrlog_decode.cc
+ * @author Saphereye
+ * @brief herrlog-decode: turns files written by BinaryFileSink back into
+ * "[LEVEL time] message" text, as the text output would have been.
+ * @note Requires C++20 or later. Build with
+ * g++ -std=c++20 -O2 tools/herrlog_decode.cc -o herrlog-decode
+ *
+ * Usage: herrlog-decode [-d datetime_format] file...
+ *
+ * @copyright Copyright (c) 2023 Adarsh Das
+ *
+ * MIT License, see herrlog.hh
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "../herrlog.hh"
+
+namespace {
+
+/**
+ * @brief A format string as defined in a file, before its first message.
+ *
+ */
+struct Definition {
+    // BinaryType of every argument, with binary_field_flag on fields
+    std::vector<std::uint8_t> types;
+    std::vector<std::size_t> argument_indexes;
+    std::vector<FormatSpec> specs;
+    std::vector<std::string> segments;
+};
+
+using Value = std::variant<bool, char, std::int8_t, std::uint8_t, std::int16_t,
+                           std::uint16_t, std::int32_t, std::uint32_t,
+                           std::int64_t, std::uint64_t, float, double,
+                           std::string_view>;
+
+/**
+ * @brief An argument of a message, with its key if it is a field.
+ *
+ */
+struct Argument {
+    std::string_view key;
+    Value value;
+};
+
+/**
+ * @brief Reads the entries of a file, throws std::runtime_error when the file
+ * ends in the middle of one.
+ *
+ */
+class Reader {
+   private:
+    std::string_view data;
+    std::size_t position = 0;
+
+    void require(std::size_t size) const {
+        if (data.size() - position < size) {
+            throw std::runtime_error("truncated file");
+        }
+    }
+
+   public:
+    explicit Reader(std::string_view file_data) : data(file_data) {}
+
+    bool is_at_end() const { return position == data.size(); }
+
+    std::uint8_t read_byte() {
+        require(1);
+        return static_cast<std::uint8_t>(data[position++]);
+    }
+
+    std::uint64_t read_varint() {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const std::uint8_t byte = read_byte();
+            value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::runtime_error("malformed varint");
+    }
+
+    std::int64_t read_zigzag() {
+        const std::uint64_t value = read_varint();
+        return static_cast<std::int64_t>(value >> 1) ^
+               -static_cast<std::int64_t>(value & 1);
+    }
+
+    std::string_view read_string() {
+        const std::uint64_t size = read_varint();
+        require(size);
+        const std::string_view text = data.substr(position, size);
+        position += size;
+        return text;
+    }
+
+    template <typename T>
+    T read() {
+        require(sizeof(T));
+        T value;
+        std::memcpy(&value, data.data() + position, sizeof(T));
+        position += sizeof(T);
+        return value;
+    }
+
+    Value read_value(herrlog_detail::BinaryType type) {
+        using herrlog_detail::BinaryType;
+        switch (type) {
+            case BinaryType::Bool:
+                return read<std::uint8_t>() != 0;
+            case BinaryType::Char:
+                return read<char>();
+            case BinaryType::Int8:
+                return read<std::int8_t>();
+            case BinaryType::UInt8:
+                return read<std::uint8_t>();
+            case BinaryType::Int16:
+                return read<std::int16_t>();
+            case BinaryType::UInt16:
+                return read<std::uint16_t>();
+            case BinaryType::Int32:
+                return read<std::int32_t>();
+            case BinaryType::UInt32:
+                return read<std::uint32_t>();
+            case BinaryType::Int64:
+                return read<std::int64_t>();
+            case BinaryType::UInt64:
+                return read<std::uint64_t>();
+            case BinaryType::Float:
+                return read<float>();
+            case BinaryType::Double:
+                return read<double>();
+            case BinaryType::String:
+                return read_string();
+        }
+        throw std::runtime_error("unknown argument type");
+    }
+
+    Definition read_definition() {
+        Definition definition;
+        // One byte per type, check the count before allocating for it
+        const std::uint64_t type_count = read_varint();
+        require(type_count);
+        definition.types.resize(type_count);
+        for (std::uint8_t& type : definition.types) {
+            type = read_byte();
+        }
+        const std::uint64_t placeholder_count = read_varint();
+        for (std::uint64_t index = 0; index < placeholder_count; index++) {
+            const std::uint64_t argument = read_varint();
+            if (argument >= definition.types.size()) {
+                throw std::runtime_error("argument index out of range");
+            }
+            definition.argument_indexes.push_back(argument);
+            FormatSpec spec;
+            spec.fill = static_cast<char>(read_byte());
+            spec.align = static_cast<char>(read_byte());
+            spec.sign = static_cast<char>(read_byte());
+            spec.type = static_cast<char>(read_byte());
+            const std::uint8_t flags = read_byte();
+            spec.is_alternate = flags & 1;
+            spec.is_zero_padded = flags & 2;
+            spec.width = static_cast<std::uint16_t>(read_varint());
+            spec.precision = static_cast<std::int16_t>(read_zigzag());
+            definition.specs.push_back(spec);
+        }
+        for (std::uint64_t index = 0; index <= placeholder_count; index++) {
+            definition.segments.emplace_back(read_string());
+        }
+        return definition;
+    }
+};
+
+/**
+ * @brief Name of a log type as written by the logging functions.
+ *
+ * @param type
+ * @return const char*
+ */
+const char* get_level_name(std::uint8_t type) {
+    switch (type) {
+        case LogType::Trace:
+            return "TRACE";
+        case LogType::Debug:
+            return "DEBUG";
+        case LogType::Info:
+            return " INFO";
+        case LogType::Error:
+            return "ERROR";
+        case LogType::Warn:
+            return " WARN";
+        case LogType::Fatal:
+            return "FATAL";
+        default:
+            return "?????";
+    }
+}
+
+/**
+ * @brief Decodes a whole file to the output, one line per message.
+ *
+ * @param data
+ * @param datetime_format
+ * @param output
+ */
+void decode(std::string_view data, const char* datetime_format,
+            std::ostream& output) {
+    constexpr std::string_view magic("HERRLOG\1", 8);
+    if (data.substr(0, magic.size()) != magic) {
+        throw std::runtime_error("not a binary log file of this version");
+    }
+    Reader reader(data.substr(magic.size()));
+    std::unordered_map<std::uint64_t, Definition> definitions;
+    herrlog_detail::TimestampCache timestamp_cache;
+    herrlog_detail::Buffer line;
+    std::vector<Argument> arguments;
+    std::uint64_t timestamp = 0;
+
+    while (!reader.is_at_end()) {
+        const std::uint8_t type = reader.read_byte();
+        if (type == 0) {
+            const std::uint64_t format_id = reader.read_varint();
+            definitions[format_id] = reader.read_definition();
+            continue;
+        }
+
+        timestamp += static_cast<std::uint64_t>(reader.read_zigzag());
+        const auto definition_entry = definitions.find(reader.read_varint());
+        if (definition_entry == definitions.end()) {
+            throw std::runtime_error("message before its format string");
+        }
+        const Definition& definition = definition_entry->second;
+        arguments.clear();
+        for (const std::uint8_t argument_type : definition.types) {
+            Argument& argument = arguments.emplace_back();
+            if (argument_type & herrlog_detail::binary_field_flag) {
+                argument.key = reader.read_string();
+            }
+            argument.value = reader.read_value(herrlog_detail::BinaryType(
+                argument_type & ~herrlog_detail::binary_field_flag));
+        }
+
+        const std::chrono::system_clock::time_point time(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::nanoseconds(timestamp)));
+        line.clear();
+        line.push_back('[');
+        line.append(get_level_name(type));
+        line.push_back(' ');
+        line.append(timestamp_cache.format(time, datetime_format, 1));
+        line.append("] ");
+        for (std::size_t index = 0; index < definition.specs.size(); index++) {
+            line.append(definition.segments[index]);
+            std::visit(
+                [&](const auto& value) {
+                    herrlog_detail::append_formatted(line, value,
+                                                     definition.specs[index]);
+                },
+                arguments[definition.argument_indexes[index]].value);
+        }
+        line.append(definition.segments.back());
+        for (std::size_t index = 0; index < arguments.size(); index++) {
+            if (definition.types[index] & herrlog_detail::binary_field_flag) {
+                line.push_back(' ');
+                line.append(arguments[index].key);
+                line.push_back('=');
+                std::visit(
+                    [&](const auto& value) {
+                        herrlog_detail::append_argument(line, value);
+                    },
+                    arguments[index].value);
+            }
+        }
+        line.push_back('\n');
+        output.write(line.data(), static_cast<std::streamsize>(line.size()));
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const char* datetime_format = "%Y-%m-%d %H:%M:%S";
+    std::vector<const char*> file_names;
+    for (int index = 1; index < argc; index++) {
+        const std::string_view option(argv[index]);
+        if (option == "-d" && index + 1 < argc) {
+            datetime_format = argv[++index];
+        } else if (option == "-h" || option == "--help") {
+            std::cout << "Usage: " << argv[0]
+                      << " [-d datetime_format] file...\n";
+            return 0;
+        } else {
+            file_names.push_back(argv[index]);
+        }
+    }
+    if (file_names.empty()) {
+        std::cerr << "Usage: " << argv[0] << " [-d datetime_format] file...\n";
+        return 2;
+    }
+
+    int status = 0;
+    for (const char* file_name : file_names) {
+        std::ifstream file(file_name, std::ios::binary);
+        if (!file) {
+            std::cerr << file_name << ": cannot open\n";
+            status = 1;
+            continue;
+        }
+        const std::string data((std::istreambuf_iterator<char>(file)),
+                               std::istreambuf_iterator<char>());
+        try {
+            decode(data, datetime_format, std::cout);
+        } catch (const std::runtime_error& error) {
+            std::cout.flush();
+            std::cerr << file_name << ": " << error.what() << "\n";
+            status = 1;
+        }
+    }
+    return status;
+}